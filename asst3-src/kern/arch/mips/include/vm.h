@@ -82,7 +82,6 @@ kvaddr_to_paddr(vaddr_t vaddr){
  * last valid user address.)
  */
 #define USERSPACETOP  MIPS_KSEG0
-#define FIXED_SIZE_STACK 16 //stack always uses 16 pages
 /*
  * The starting value for the stack pointer at user level.  Because
  * the stack is subtract-then-store, this can start as the next
@@ -92,7 +91,14 @@ kvaddr_to_paddr(vaddr_t vaddr){
  * grows downwards.
  */
 #define USERSTACK     USERSPACETOP
-#define USERSTACKSIZE (FIXED_SIZE_STACK*PAGE_SIZE)
+
+/*
+ * The stack starts out one page long and grows down as it is touched,
+ * up to a limit that each address space keeps. This is the default
+ * limit; the space below USERSTACK down to the limit is kept free for
+ * the stack.
+ */
+#define USERSTACKMAX  (8*1024*1024)
 
 /*
  * Interface to the low-level module that looks after the amount of
@@ -127,14 +133,21 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space the page is in */
+	vaddr_t ts_vaddr;		/* page to invalidate */
+	struct semaphore *ts_done;	/* V'd when done, if not NULL */
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Size of the per-cpu cache of free page frames (struct cpu c_frames).
+ */
+#define FRAMECACHE_MAX 32
+
 
 #endif /* _MIPS_VM_H_ */
@@ -211,6 +211,10 @@ syscall(struct trapframe *tf)
 		}
 		break;
 
+	    case SYS_fsync:
+		err = sys_fsync(tf->tf_a0);
+		break;
+
 	    case SYS_chdir:
 		err = sys_chdir((userptr_t)tf->tf_a0);
 		break;
@@ -223,6 +227,53 @@ syscall(struct trapframe *tf)
 		break;
 
 
+	    /* memory calls */
+
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * The offset is 64 bits wide and has to start
+			 * in an even register, so a3 is skipped and it
+			 * comes from the stack.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       offset, &retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+
+	    case SYS_madvise:
+		err = sys_madvise((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+
+	    case SYS_getrusage:
+		err = sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_getrlimit:
+		err = sys_getrlimit(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_setrlimit:
+		err = sys_setrlimit(tf->tf_a0, (const_userptr_t)tf->tf_a1);
+		break;
+
+
 	    /* Even more system calls will go here */
 
 
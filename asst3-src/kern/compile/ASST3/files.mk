@@ -40,6 +40,7 @@ SRCS+=$(KTOP)/fs/semfs/semfs_obj.c
 SRCS+=$(KTOP)/fs/semfs/semfs_vnops.c
 SRCS+=$(KTOP)/fs/sfs/sfs_balloc.c
 SRCS+=$(KTOP)/fs/sfs/sfs_bmap.c
+SRCS+=$(KTOP)/fs/sfs/sfs_buf.c
 SRCS+=$(KTOP)/fs/sfs/sfs_dir.c
 SRCS+=$(KTOP)/fs/sfs/sfs_fsops.c
 SRCS+=$(KTOP)/fs/sfs/sfs_inode.c
@@ -64,6 +65,7 @@ SRCS+=$(KTOP)/syscall/openfile.c
 SRCS+=$(KTOP)/syscall/proc_syscalls.c
 SRCS+=$(KTOP)/syscall/runprogram.c
 SRCS+=$(KTOP)/syscall/time_syscalls.c
+SRCS+=$(KTOP)/syscall/vm_syscalls.c
 SRCS+=$(KTOP)/test/arraytest.c
 SRCS+=$(KTOP)/test/bitmaptest.c
 SRCS+=$(KTOP)/test/fstest.c
@@ -91,6 +93,8 @@ SRCS+=$(KTOP)/vfs/vnode.c
 SRCS+=$(KTOP)/vm/addrspace.c
 SRCS+=$(KTOP)/vm/frametable.c
 SRCS+=$(KTOP)/vm/kmalloc.c
+SRCS+=$(KTOP)/vm/pagecache.c
+SRCS+=$(KTOP)/vm/swap.c
 SRCS+=$(KTOP)/vm/vm.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/adddi3.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/anddi3.c
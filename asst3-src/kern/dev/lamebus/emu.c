@@ -261,6 +261,27 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 	return result;
 }
 
+/*
+ * A user buffer can fault while we copy to or from it, and the fault
+ * may need the emulator itself (to page in part of a mapped file), so
+ * user data goes through a buffer of our own and is copied while we
+ * aren't holding e_lock. Gets a buffer for LEN bytes, or NULL in *RET
+ * if none is needed.
+ */
+static
+int
+emu_getbounce(struct uio *uio, uint32_t len, char **ret)
+{
+	*ret = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE && len > 0) {
+		*ret = kmalloc(len);
+		if (*ret == NULL) {
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
 /*
  * Common code for read and readdir.
  */
@@ -269,15 +290,24 @@ int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	char *bounce;
+	uint32_t got;
+	off_t newoffset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(len <= EMU_MAXIO);
 
 	if (uio->uio_offset > (off_t)0xffffffff) {
 		/* beyond the largest size the file can have; generate EOF */
 		return 0;
 	}
 
+	result = emu_getbounce(uio, len, &bounce);
+	if (result) {
+		return result;
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -286,16 +316,31 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_OPER, op);
 	result = emu_waitdone(sc);
 	if (result) {
+		lock_release(sc->e_lock);
 		goto out;
 	}
 
 	membar_load_load();
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
+	got = emu_rreg(sc, REG_IOLEN);
+	newoffset = emu_rreg(sc, REG_OFFSET);
+	if (bounce != NULL) {
+		memcpy(bounce, sc->e_iobuf, got);
+	}
+	else {
+		result = uiomove(sc->e_iobuf, got, uio);
+	}
+
+	lock_release(sc->e_lock);
 
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	if (bounce != NULL) {
+		result = uiomove(bounce, got, uio);
+	}
+	uio->uio_offset = newoffset;
 
  out:
-	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -329,21 +374,42 @@ int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	char *bounce;
+	off_t offset = uio->uio_offset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(len <= EMU_MAXIO);
 
 	if (uio->uio_offset > (off_t)0xffffffff) {
 		return EFBIG;
 	}
 
+	/* see emu_getbounce */
+	result = emu_getbounce(uio, len, &bounce);
+	if (result) {
+		return result;
+	}
+	if (bounce != NULL) {
+		result = uiomove(bounce, len, uio);
+		if (result) {
+			kfree(bounce);
+			return result;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	emu_wreg(sc, REG_OFFSET, offset);
 
-	result = uiomove(sc->e_iobuf, len, uio);
+	if (bounce != NULL) {
+		memcpy(sc->e_iobuf, bounce, len);
+	}
+	else {
+		result = uiomove(sc->e_iobuf, len, uio);
+	}
 	membar_store_store();
 	if (result) {
 		goto out;
@@ -354,6 +420,9 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 
  out:
 	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -844,14 +913,15 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 }
 
 /*
- * VOP_MMAP
+ * VOP_MMAP - files can be mapped, the page cache reads and writes
+ * them with emufs_read and emufs_write.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -194,7 +194,8 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
 	uint32_t i;
 	uint32_t statval = LHD_WORKING;
-	int result;
+	char *bounce = NULL;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -212,9 +213,29 @@ lhd_io(struct device *d, struct uio *uio)
 		statval |= LHD_ISWRITE;
 	}
 
+	/*
+	 * A user buffer can fault while we copy to or from it, and the
+	 * fault may need this disk itself (to page in part of a file),
+	 * so user data goes through a buffer of our own and is copied
+	 * while we aren't holding the device.
+	 */
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = kmalloc(LHD_SECTSIZE);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+	}
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
+		if (bounce != NULL && uio->uio_rw == UIO_WRITE) {
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
+		}
+
 		/* Wait until nobody else is using the device. */
 		P(lh->lh_clear);
 
@@ -223,11 +244,17 @@ lhd_io(struct device *d, struct uio *uio)
 		 * on-card buffer.
 		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			if (bounce != NULL) {
+				memcpy(lh->lh_buf, bounce, LHD_SECTSIZE);
+				result = 0;
+			}
+			else {
+				result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			}
 			membar_store_store();
 			if (result) {
 				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
@@ -249,19 +276,31 @@ lhd_io(struct device *d, struct uio *uio)
 		 */
 		if (result==0 && uio->uio_rw==UIO_READ) {
 			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			if (bounce != NULL) {
+				memcpy(bounce, lh->lh_buf, LHD_SECTSIZE);
+			}
+			else {
+				result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			}
 		}
 
 		/* Tell another thread it's cleared to go ahead. */
 		V(lh->lh_clear);
 
+		if (result==0 && bounce != NULL && uio->uio_rw==UIO_READ) {
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
+		}
+
 		/* If we failed, return the error. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
 
-	return 0;
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -50,13 +51,10 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
 	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * The indirect block, in the buffer cache.
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_buf *idbufp;
+	uint32_t *idbuf;
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t block;
@@ -64,10 +62,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* The block map had better be locked. */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -154,18 +150,17 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* sfs_balloc left it zeroed in the buffer cache */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Load the indirect block.
+	 */
+	result = sfs_bread(sfs, idblock, &idbufp);
+	if (result) {
+		return result;
 	}
+	idbuf = sfs_bdata(idbufp);
 
 	/* Get the block out of the indirect block buffer */
 	block = idbuf[idoff];
@@ -174,18 +169,15 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	if (block==0 && doalloc) {
 		result = sfs_balloc(sfs, &block);
 		if (result) {
+			sfs_brelse(idbufp);
 			return result;
 		}
 
-		/* Remember the block we allocated */
+		/* Remember the block we allocated; the buffer is dirty */
 		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+		sfs_bdirty(idbufp, sv->sv_ino);
 	}
+	sfs_brelse(idbufp);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -204,13 +196,10 @@ int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
 	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * The indirect block, in the buffer cache.
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_buf *idbufp;
+	uint32_t *idbuf;
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
@@ -223,9 +212,8 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+	/* The caller locks the vnode. */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -253,11 +241,11 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		/* We're past the proposed EOF; may need to free stuff */
 
 		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_bread(sfs, idblock, &idbufp);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+		idbuf = sfs_bdata(idbufp);
 
 		hasnonzero = 0;
 		iddirty = 0;
@@ -274,21 +262,18 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 			}
 		}
 
+		if (iddirty) {
+			/* The indirect block is dirty */
+			sfs_bdirty(idbufp, sv->sv_ino);
+		}
+		sfs_brelse(idbufp);
+
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
 			sfs_bfree(sfs, idblock);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
 	/* Set the file size */
@@ -297,7 +282,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
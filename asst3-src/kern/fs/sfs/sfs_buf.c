@@ -0,0 +1,963 @@
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Every block SFS reads or writes goes through here: file data,
+ * directories, indirect blocks, inodes, the freemap and the
+ * superblock. Buffers are hashed on (device, block). Whoever uses a
+ * buffer pins it (sfs_bread/sfs_bget) and unpins it (sfs_brelse);
+ * unpinned buffers go on an LRU list, and when there are SFS_NBUF
+ * buffers already the least recently used clean one is taken for the
+ * next block (a dirty one is written out first only if there is no
+ * clean one). Writes only mark the buffer dirty; sfs_bsync writes
+ * dirty buffers back, and so does the syncer thread, once a second,
+ * for buffers that have been dirty for SFS_DIRTYAGE seconds or while
+ * more than SFS_DIRTYMAX are dirty, oldest first.
+ *
+ * buf_lock covers everything here and is never held across I/O. A
+ * buffer being read in (or filled by an sfs_bget caller) is b_busy and
+ * nobody else may use it; one being written out is b_writing, which
+ * only keeps a second write of it away. Both wait on buf_wchan.
+ *
+ * If every buffer is pinned a new one is allocated anyway rather than
+ * waiting, and the extra buffers are freed again as they are unpinned.
+ *
+ * Read-ahead: sfs_bprefetch queues blocks for the read-ahead thread,
+ * which reads them into the cache one at a time while the reader that
+ * asked for them is off doing something else. buf_rafs is the file
+ * system it is reading for, so sfs_bpurge can wait for it. A buffer
+ * read that way is b_prefetched until somebody reads it (a read-ahead
+ * hit) or it leaves the cache unread (wasted).
+ */
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* file system the block is on */
+	struct device *b_dev;		/* ...and its device */
+	daddr_t b_block;
+	void *b_data;			/* SFS_BLOCKSIZE bytes */
+	uint32_t b_ino;			/* file it was dirtied for, or 0 */
+	unsigned b_pins;		/* users holding the buffer */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* the disk doesn't */
+	bool b_busy;			/* being read in or filled */
+	bool b_writing;			/* being written out */
+	bool b_prefetched;		/* read ahead, not used yet */
+	unsigned b_dirtytime;		/* buf_clock when it got dirty */
+	unsigned b_syncgen;		/* last sfs_bsync that saw it */
+	struct sfs_buf *b_next;		/* hash chain */
+	struct sfs_buf *b_lruprev;	/* LRU list, while unpinned */
+	struct sfs_buf *b_lrunext;
+};
+
+#define SFS_NBUF	128
+#define SFS_BUFHASH	64
+#define SFS_RAQUEUE	64		/* read-ahead requests queued */
+#define SFS_DIRTYAGE	3		/* seconds a buffer may stay dirty */
+#define SFS_DIRTYMAX	(SFS_NBUF / 4)	/* dirty buffers before the
+					   syncer writes younger ones */
+
+static struct sfs_buf *buf_hash[SFS_BUFHASH];
+static struct sfs_buf *buf_lruhead, *buf_lrutail;
+static struct spinlock buf_lock = SPINLOCK_INITIALIZER;
+static struct wchan *buf_wchan;
+static unsigned buf_syncgen = 0;
+
+static unsigned buf_count = 0;		/* buffers in the hash table */
+static unsigned buf_ndirty = 0;		/* ...and dirty ones */
+static unsigned buf_clock = 0;		/* seconds, ticked by the syncer */
+static struct sfs_fs *buf_mounts;	/* mounted sfs, for the syncer */
+static struct lock *buf_mountlock;	/* covers buf_mounts */
+static unsigned buf_hits = 0;
+static unsigned buf_misses = 0;
+static unsigned buf_writebacks = 0;
+static unsigned buf_evictions = 0;
+static unsigned buf_coalesced = 0;	/* writes to a dirty buffer */
+static unsigned buf_syncerwrites = 0;
+
+/* read-ahead queue, a ring, and its thread's wchan */
+static struct {
+	struct sfs_fs *rq_fs;
+	daddr_t rq_block;
+} buf_raq[SFS_RAQUEUE];
+static unsigned buf_raqhead = 0, buf_raqcount = 0;
+static struct wchan *buf_rawchan;
+static struct sfs_fs *buf_rafs;		/* read-ahead in progress for */
+
+static unsigned buf_rarequests = 0;	/* sfs_bprefetch calls */
+static unsigned buf_rawinsum = 0;	/* their windows added up */
+static unsigned buf_rawinmax = 0;	/* largest window */
+static unsigned buf_raread = 0;		/* blocks actually read ahead */
+static unsigned buf_rahits = 0;
+static unsigned buf_rawasted = 0;
+
+static void buf_readahead_thread(void *data1, unsigned long data2);
+static void buf_syncer_thread(void *data1, unsigned long data2);
+
+void
+sfs_bbootstrap(void)
+{
+	int result;
+
+	if (buf_wchan != NULL) {
+		return;
+	}
+
+	buf_wchan = wchan_create("sfsbuf");
+	buf_rawchan = wchan_create("sfsreadahead");
+	buf_mountlock = lock_create("sfsmounts");
+	if (buf_wchan == NULL || buf_rawchan == NULL ||
+	    buf_mountlock == NULL) {
+		panic("sfs: wchan_create for the buffer cache failed\n");
+	}
+	result = thread_fork("sfsreadahead", NULL, buf_readahead_thread,
+			     NULL, 0);
+	if (result) {
+		panic("sfs: thread_fork for read-ahead failed: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("sfssyncer", NULL, buf_syncer_thread, NULL, 0);
+	if (result) {
+		panic("sfs: thread_fork for the syncer failed: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * SFS is mounted now; let the syncer write its metadata.
+ */
+void
+sfs_bmount(struct sfs_fs *sfs)
+{
+	lock_acquire(buf_mountlock);
+	sfs->sfs_next = buf_mounts;
+	buf_mounts = sfs;
+	lock_release(buf_mountlock);
+}
+
+static
+unsigned
+buf_hashfn(struct device *dev, daddr_t block)
+{
+	return ((uintptr_t)dev / sizeof(void *) + block) % SFS_BUFHASH;
+}
+
+/*
+ * Hash and LRU list helpers. Call with buf_lock held.
+ */
+
+static
+struct sfs_buf *
+buf_lookup(struct device *dev, daddr_t block)
+{
+	struct sfs_buf *buf;
+
+	for (buf = buf_hash[buf_hashfn(dev, block)]; buf != NULL;
+	     buf = buf->b_next) {
+		if (buf->b_dev == dev && buf->b_block == block) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hash_insert(struct sfs_buf *buf)
+{
+	unsigned h = buf_hashfn(buf->b_dev, buf->b_block);
+
+	buf->b_next = buf_hash[h];
+	buf_hash[h] = buf;
+	buf_count++;
+}
+
+static
+void
+buf_hash_remove(struct sfs_buf *buf)
+{
+	struct sfs_buf **bp;
+
+	bp = &buf_hash[buf_hashfn(buf->b_dev, buf->b_block)];
+	while (*bp != buf) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_next;
+	}
+	*bp = buf->b_next;
+	buf_count--;
+	if (buf->b_dirty) {
+		/* freed, nobody needs it written any more */
+		buf_ndirty--;
+	}
+	if (buf->b_prefetched) {
+		/* read ahead for nothing */
+		buf_rawasted++;
+	}
+}
+
+static
+void
+buf_lru_append(struct sfs_buf *buf)
+{
+	buf->b_lrunext = NULL;
+	buf->b_lruprev = buf_lrutail;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = buf;
+	}
+	else {
+		buf_lruhead = buf;
+	}
+	buf_lrutail = buf;
+}
+
+static
+void
+buf_lru_prepend(struct sfs_buf *buf)
+{
+	buf->b_lruprev = NULL;
+	buf->b_lrunext = buf_lruhead;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = buf;
+	}
+	else {
+		buf_lrutail = buf;
+	}
+	buf_lruhead = buf;
+}
+
+static
+void
+buf_lru_remove(struct sfs_buf *buf)
+{
+	if (buf->b_lruprev != NULL) {
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	}
+	else {
+		buf_lruhead = buf->b_lrunext;
+	}
+	if (buf->b_lrunext != NULL) {
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+	}
+	else {
+		buf_lrutail = buf->b_lruprev;
+	}
+	buf->b_lruprev = buf->b_lrunext = NULL;
+}
+
+static
+void
+buf_pin(struct sfs_buf *buf)
+{
+	if (buf->b_pins == 0) {
+		buf_lru_remove(buf);
+	}
+	buf->b_pins++;
+}
+
+static
+void
+buf_free(struct sfs_buf *buf)
+{
+	kfree(buf->b_data);
+	kfree(buf);
+}
+
+/*
+ * Block I/O on a buffer. No locks held.
+ */
+static
+int
+buf_io(struct sfs_buf *buf, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	SFSUIO(&iov, &ku, buf->b_data, buf->b_block, rw);
+	return sfs_rwblock(buf->b_fs, &ku);
+}
+
+/*
+ * Write out BUF, which is dirty, not busy and not being written
+ * already, and which the caller has pinned.
+ * Called with buf_lock held; drops it for the I/O. The buffer stays
+ * dirty if the write fails, or if it was dirtied again meanwhile.
+ */
+static
+int
+buf_write_locked(struct sfs_buf *buf)
+{
+	int result;
+
+	KASSERT(buf->b_dirty && buf->b_valid);
+	KASSERT(!buf->b_busy && !buf->b_writing);
+	buf->b_writing = true;
+	buf->b_dirty = false;
+	buf_ndirty--;
+	spinlock_release(&buf_lock);
+
+	result = buf_io(buf, UIO_WRITE);
+
+	spinlock_acquire(&buf_lock);
+	buf->b_writing = false;
+	if (result && !buf->b_dirty) {
+		/* keeps its old b_dirtytime */
+		buf->b_dirty = true;
+		buf_ndirty++;
+	}
+	else if (result == 0) {
+		buf_writebacks++;
+	}
+	wchan_wakeall(buf_wchan, &buf_lock);
+	return result;
+}
+
+/*
+ * Find or make the buffer for BLOCK of SFS and pin it. If it wasn't
+ * cached it comes back busy and not valid, for the caller to fill.
+ */
+static
+int
+buf_get(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf, *newbuf = NULL;
+	int result;
+
+	KASSERT(buf_wchan != NULL);
+
+	spinlock_acquire(&buf_lock);
+	while (1) {
+		buf = buf_lookup(sfs->sfs_device, block);
+		if (buf != NULL && buf->b_busy) {
+			wchan_sleep(buf_wchan, &buf_lock);
+			continue;
+		}
+		if (buf != NULL) {
+			buf_pin(buf);
+			spinlock_release(&buf_lock);
+			if (newbuf != NULL) {
+				/* somebody else got it in meanwhile */
+				buf_free(newbuf);
+			}
+			*ret = buf;
+			return 0;
+		}
+		if (newbuf != NULL) {
+			break;
+		}
+
+		if (buf_count >= SFS_NBUF && buf_lruhead != NULL) {
+			/*
+			 * Take the least recently used clean buffer, or
+			 * write out the least recently used one.
+			 */
+			for (buf = buf_lruhead; buf != NULL;
+			     buf = buf->b_lrunext) {
+				if (!buf->b_dirty) {
+					break;
+				}
+			}
+			if (buf == NULL) {
+				buf = buf_lruhead;
+			}
+			if (buf->b_dirty) {
+				buf_pin(buf);
+				result = buf_write_locked(buf);
+				buf->b_pins--;
+				if (result) {
+					if (buf->b_pins == 0) {
+						buf_lru_append(buf);
+					}
+					spinlock_release(&buf_lock);
+					return result;
+				}
+				/* look again; it's next if nobody wants it */
+				if (buf->b_pins == 0) {
+					buf_lru_prepend(buf);
+				}
+				continue;
+			}
+			buf_lru_remove(buf);
+			buf_hash_remove(buf);
+			buf_evictions++;
+			newbuf = buf;
+			continue;
+		}
+
+		/* allocate another one */
+		spinlock_release(&buf_lock);
+		newbuf = kmalloc(sizeof(*newbuf));
+		if (newbuf == NULL) {
+			return ENOMEM;
+		}
+		newbuf->b_data = kmalloc(SFS_BLOCKSIZE);
+		if (newbuf->b_data == NULL) {
+			kfree(newbuf);
+			return ENOMEM;
+		}
+		spinlock_acquire(&buf_lock);
+	}
+
+	buf = newbuf;
+	buf->b_fs = sfs;
+	buf->b_dev = sfs->sfs_device;
+	buf->b_block = block;
+	buf->b_ino = 0;
+	buf->b_pins = 1;
+	buf->b_valid = false;
+	buf->b_dirty = false;
+	buf->b_busy = true;
+	buf->b_writing = false;
+	buf->b_prefetched = false;
+	buf->b_syncgen = 0;
+	buf->b_lruprev = buf->b_lrunext = NULL;
+	buf_hash_insert(buf);
+	spinlock_release(&buf_lock);
+
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Drop BUF, which is busy and was never filled, from the cache.
+ */
+static
+void
+buf_abandon(struct sfs_buf *buf)
+{
+	spinlock_acquire(&buf_lock);
+	KASSERT(buf->b_busy && !buf->b_valid && buf->b_pins == 1);
+	buf_hash_remove(buf);
+	wchan_wakeall(buf_wchan, &buf_lock);
+	spinlock_release(&buf_lock);
+	buf_free(buf);
+}
+
+int
+sfs_bread(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	result = buf_get(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	if (buf->b_valid) {
+		spinlock_acquire(&buf_lock);
+		buf_hits++;
+		if (buf->b_prefetched) {
+			buf->b_prefetched = false;
+			buf_rahits++;
+		}
+		spinlock_release(&buf_lock);
+		*ret = buf;
+		return 0;
+	}
+
+	result = buf_io(buf, UIO_READ);
+	if (result) {
+		buf_abandon(buf);
+		return result;
+	}
+
+	spinlock_acquire(&buf_lock);
+	buf_misses++;
+	buf->b_valid = true;
+	buf->b_busy = false;
+	wchan_wakeall(buf_wchan, &buf_lock);
+	spinlock_release(&buf_lock);
+
+	*ret = buf;
+	return 0;
+}
+
+int
+sfs_bget(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	return buf_get(sfs, block, ret);
+}
+
+void *
+sfs_bdata(struct sfs_buf *buf)
+{
+	return buf->b_data;
+}
+
+void
+sfs_bdirty(struct sfs_buf *buf, uint32_t ino)
+{
+	spinlock_acquire(&buf_lock);
+	KASSERT(buf->b_pins > 0);
+	if (!buf->b_valid) {
+		/* filled by an sfs_bget caller */
+		KASSERT(buf->b_busy);
+		buf->b_valid = true;
+		buf->b_busy = false;
+		wchan_wakeall(buf_wchan, &buf_lock);
+	}
+	if (buf->b_prefetched) {
+		/* overwritten before anybody read it */
+		buf->b_prefetched = false;
+		buf_rawasted++;
+	}
+	if (buf->b_dirty) {
+		/* one write-back will do for both */
+		buf_coalesced++;
+	}
+	else {
+		buf->b_dirty = true;
+		buf->b_dirtytime = buf_clock;
+		buf_ndirty++;
+	}
+	buf->b_ino = ino;
+	spinlock_release(&buf_lock);
+}
+
+void
+sfs_brelse(struct sfs_buf *buf)
+{
+	if (!buf->b_valid) {
+		/* from sfs_bget and never filled */
+		buf_abandon(buf);
+		return;
+	}
+
+	spinlock_acquire(&buf_lock);
+	KASSERT(buf->b_pins > 0);
+	buf->b_pins--;
+	if (buf->b_pins == 0) {
+		if (buf_count > SFS_NBUF && !buf->b_dirty &&
+		    !buf->b_writing) {
+			/* one of the extra ones, let it go */
+			buf_hash_remove(buf);
+			spinlock_release(&buf_lock);
+			buf_free(buf);
+			return;
+		}
+		buf_lru_append(buf);
+	}
+	spinlock_release(&buf_lock);
+}
+
+/*
+ * Write back the dirty buffers of SFS, or only those dirtied for file
+ * INO if it isn't 0; each at most once. The lock is dropped for I/O
+ * and for waiting, after which the hash chain is scanned again from
+ * the top; b_syncgen marks the buffers already dealt with.
+ */
+int
+sfs_bsync(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_buf *buf;
+	unsigned gen, i;
+	int result = 0, err;
+
+	spinlock_acquire(&buf_lock);
+	gen = ++buf_syncgen;
+	for (i = 0; i < SFS_BUFHASH; i++) {
+	again:
+		for (buf = buf_hash[i]; buf != NULL; buf = buf->b_next) {
+			if (buf->b_fs != sfs || buf->b_syncgen == gen) {
+				continue;
+			}
+			if (ino != 0 && buf->b_ino != ino) {
+				continue;
+			}
+			if (buf->b_busy || buf->b_writing) {
+				wchan_sleep(buf_wchan, &buf_lock);
+				goto again;
+			}
+			buf->b_syncgen = gen;
+			if (buf->b_dirty) {
+				buf_pin(buf);
+				err = buf_write_locked(buf);
+				if (err && result == 0) {
+					result = err;
+				}
+				buf->b_pins--;
+				if (buf->b_pins == 0) {
+					buf_lru_append(buf);
+				}
+				goto again;
+			}
+		}
+	}
+	spinlock_release(&buf_lock);
+	return result;
+}
+
+/*
+ * Write back BLOCK of SFS if it is cached and dirty.
+ */
+int
+sfs_bwrite(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+	int result = 0;
+
+	spinlock_acquire(&buf_lock);
+	while ((buf = buf_lookup(sfs->sfs_device, block)) != NULL &&
+	       (buf->b_busy || buf->b_writing)) {
+		wchan_sleep(buf_wchan, &buf_lock);
+	}
+	if (buf != NULL && buf->b_dirty) {
+		buf_pin(buf);
+		result = buf_write_locked(buf);
+		buf->b_pins--;
+		if (buf->b_pins == 0) {
+			buf_lru_append(buf);
+		}
+	}
+	spinlock_release(&buf_lock);
+	return result;
+}
+
+/*
+ * Queue NBLOCKS blocks of SFS to be read ahead, for a reader whose
+ * read-ahead window is WINDOW blocks. Requests that don't fit in the
+ * queue are forgotten; it's only a hint.
+ */
+void
+sfs_bprefetch(struct sfs_fs *sfs, unsigned window,
+	      const daddr_t *blocks, unsigned nblocks)
+{
+	unsigned i;
+
+	spinlock_acquire(&buf_lock);
+	buf_rarequests++;
+	buf_rawinsum += window;
+	if (window > buf_rawinmax) {
+		buf_rawinmax = window;
+	}
+	for (i = 0; i < nblocks && buf_raqcount < SFS_RAQUEUE; i++) {
+		buf_raq[(buf_raqhead + buf_raqcount) % SFS_RAQUEUE].rq_fs =
+			sfs;
+		buf_raq[(buf_raqhead + buf_raqcount) % SFS_RAQUEUE].rq_block =
+			blocks[i];
+		buf_raqcount++;
+	}
+	wchan_wakeone(buf_rawchan, &buf_lock);
+	spinlock_release(&buf_lock);
+}
+
+/*
+ * Read BLOCK of SFS into the cache, unless it is there already.
+ */
+static
+void
+buf_readahead(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	result = buf_get(sfs, block, &buf);
+	if (result) {
+		return;
+	}
+	if (buf->b_valid) {
+		sfs_brelse(buf);
+		return;
+	}
+
+	result = buf_io(buf, UIO_READ);
+	if (result) {
+		buf_abandon(buf);
+		return;
+	}
+
+	spinlock_acquire(&buf_lock);
+	buf_raread++;
+	buf->b_valid = true;
+	buf->b_busy = false;
+	buf->b_prefetched = true;
+	wchan_wakeall(buf_wchan, &buf_lock);
+	spinlock_release(&buf_lock);
+
+	sfs_brelse(buf);
+}
+
+/*
+ * The read-ahead thread. It sets buf_rafs when it takes a request off
+ * the queue, so sfs_bpurge can wait for the one in progress after
+ * taking the others away.
+ */
+static
+void
+buf_readahead_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs;
+	daddr_t block;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&buf_lock);
+		while (buf_raqcount == 0) {
+			wchan_sleep(buf_rawchan, &buf_lock);
+		}
+		sfs = buf_raq[buf_raqhead].rq_fs;
+		block = buf_raq[buf_raqhead].rq_block;
+		buf_raqhead = (buf_raqhead + 1) % SFS_RAQUEUE;
+		buf_raqcount--;
+		buf_rafs = sfs;
+		spinlock_release(&buf_lock);
+
+		buf_readahead(sfs, block);
+
+		spinlock_acquire(&buf_lock);
+		buf_rafs = NULL;
+		wchan_wakeall(buf_wchan, &buf_lock);
+		spinlock_release(&buf_lock);
+	}
+}
+
+/*
+ * Pick the buffer the syncer should write next: the one that has been
+ * dirty longest, if that is SFS_DIRTYAGE seconds or there are too many
+ * dirty buffers. Call with buf_lock held.
+ */
+static
+struct sfs_buf *
+buf_syncer_pick(void)
+{
+	struct sfs_buf *buf, *oldest = NULL;
+	unsigned i;
+
+	for (i = 0; i < SFS_BUFHASH; i++) {
+		for (buf = buf_hash[i]; buf != NULL; buf = buf->b_next) {
+			if (!buf->b_dirty || buf->b_writing) {
+				continue;
+			}
+			if (oldest == NULL ||
+			    buf->b_dirtytime < oldest->b_dirtytime) {
+				oldest = buf;
+			}
+		}
+	}
+	if (oldest == NULL) {
+		return NULL;
+	}
+	if (buf_clock - oldest->b_dirtytime < SFS_DIRTYAGE &&
+	    buf_ndirty <= SFS_DIRTYMAX) {
+		return NULL;
+	}
+	return oldest;
+}
+
+/*
+ * The syncer thread. Once a second it copies the dirty metadata of
+ * every mounted sfs into the cache and then writes back buffers that
+ * are old enough, or as many as it takes to get the dirty count down
+ * to SFS_DIRTYMAX. buf_mountlock keeps sfs_bpurge from taking a file
+ * system away while its metadata is being written.
+ */
+static
+void
+buf_syncer_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs;
+	struct sfs_buf *buf;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(1);
+
+		lock_acquire(buf_mountlock);
+		for (sfs = buf_mounts; sfs != NULL; sfs = sfs->sfs_next) {
+			/* errors come back to whoever syncs next */
+			sfs_writemeta(sfs);
+		}
+		lock_release(buf_mountlock);
+
+		spinlock_acquire(&buf_lock);
+		buf_clock++;
+		spinlock_release(&buf_lock);
+
+		while (1) {
+			spinlock_acquire(&buf_lock);
+			buf = buf_syncer_pick();
+			if (buf == NULL) {
+				spinlock_release(&buf_lock);
+				break;
+			}
+			buf_pin(buf);
+			result = buf_write_locked(buf);
+			if (result == 0) {
+				buf_syncerwrites++;
+			}
+			buf->b_pins--;
+			if (buf->b_pins == 0) {
+				buf_lru_append(buf);
+			}
+			spinlock_release(&buf_lock);
+			if (result) {
+				/* try again next time */
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Forget the queued read-ahead requests for SFS. Call with buf_lock
+ * held.
+ */
+static
+void
+buf_raq_purge(struct sfs_fs *sfs)
+{
+	unsigned i, j, count;
+
+	count = 0;
+	for (i = 0; i < buf_raqcount; i++) {
+		j = (buf_raqhead + i) % SFS_RAQUEUE;
+		if (buf_raq[j].rq_fs != sfs) {
+			buf_raq[(buf_raqhead + count) % SFS_RAQUEUE] =
+				buf_raq[j];
+			count++;
+		}
+	}
+	buf_raqcount = count;
+}
+
+void
+sfs_bdrop(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+
+	spinlock_acquire(&buf_lock);
+	buf = buf_lookup(sfs->sfs_device, block);
+	if (buf == NULL || buf->b_pins > 0 || buf->b_busy ||
+	    buf->b_writing) {
+		spinlock_release(&buf_lock);
+		return;
+	}
+	/* the block is free, what was in it doesn't matter any more */
+	buf_lru_remove(buf);
+	buf_hash_remove(buf);
+	spinlock_release(&buf_lock);
+	buf_free(buf);
+}
+
+int
+sfs_bpurge(struct sfs_fs *sfs)
+{
+	struct sfs_fs **mp;
+	struct sfs_buf *buf, *dead;
+	unsigned i;
+	bool mounted = false;
+	int result;
+
+	/* the syncer is done with it */
+	lock_acquire(buf_mountlock);
+	for (mp = &buf_mounts; *mp != NULL; mp = &(*mp)->sfs_next) {
+		if (*mp == sfs) {
+			*mp = sfs->sfs_next;
+			mounted = true;
+			break;
+		}
+	}
+	lock_release(buf_mountlock);
+
+	/* and so is read-ahead */
+	spinlock_acquire(&buf_lock);
+	buf_raq_purge(sfs);
+	while (buf_rafs == sfs) {
+		wchan_sleep(buf_wchan, &buf_lock);
+	}
+	spinlock_release(&buf_lock);
+
+	result = sfs_bsync(sfs, 0);
+	if (result) {
+		if (mounted) {
+			/* still mounted after all */
+			sfs_bmount(sfs);
+		}
+		return result;
+	}
+
+	spinlock_acquire(&buf_lock);
+	for (i = 0; i < SFS_BUFHASH; i++) {
+		dead = NULL;
+		buf = buf_hash[i];
+		while (buf != NULL) {
+			if (buf->b_fs != sfs) {
+				buf = buf->b_next;
+				continue;
+			}
+			KASSERT(buf->b_pins == 0 && !buf->b_dirty);
+			buf_lru_remove(buf);
+			buf_hash_remove(buf);
+			/* reuse b_next to chain the dead ones */
+			buf->b_next = dead;
+			dead = buf;
+			buf = buf_hash[i];
+		}
+		if (dead != NULL) {
+			spinlock_release(&buf_lock);
+			while (dead != NULL) {
+				buf = dead;
+				dead = buf->b_next;
+				buf_free(buf);
+			}
+			spinlock_acquire(&buf_lock);
+		}
+	}
+	spinlock_release(&buf_lock);
+	return 0;
+}
+
+void
+sfs_printstats(void)
+{
+	unsigned count, dirty, hits, misses, writebacks, evictions;
+	unsigned coalesced, syncerwrites;
+	unsigned requests, winsum, winmax, raread, rahits, rawasted;
+
+	spinlock_acquire(&buf_lock);
+	count = buf_count;
+	dirty = buf_ndirty;
+	hits = buf_hits;
+	misses = buf_misses;
+	writebacks = buf_writebacks;
+	evictions = buf_evictions;
+	coalesced = buf_coalesced;
+	syncerwrites = buf_syncerwrites;
+	requests = buf_rarequests;
+	winsum = buf_rawinsum;
+	winmax = buf_rawinmax;
+	raread = buf_raread;
+	rahits = buf_rahits;
+	rawasted = buf_rawasted;
+	spinlock_release(&buf_lock);
+
+	kprintf("sfs buffer cache: %u buffers (%u dirty), %u hits, "
+		"%u misses (%u%% hit rate), %u write-backs, %u evictions\n",
+		count, dirty, hits, misses,
+		hits + misses ? hits * 100 / (hits + misses) : 0,
+		writebacks, evictions);
+	kprintf("sfs write-back: %u writes coalesced, %u buffers written "
+		"by the syncer\n", coalesced, syncerwrites);
+	kprintf("sfs read-ahead: window %u blocks on average, %u at most; "
+		"%u blocks read ahead, %u hits, %u wasted\n",
+		requests ? winsum / requests : 0, winmax,
+		raread, rahits, rawasted);
+}
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -50,10 +51,26 @@
 #define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
 #define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
 
+/* There's no memcmp in the kernel. */
+static
+bool
+sfs_sameblock(const void *a, const void *b)
+{
+	const uint32_t *wa = a, *wb = b;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE/sizeof(uint32_t); i++) {
+		if (wa[i] != wb[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * We always go over the whole bitmap at once, but when writing only
+ * the sectors that changed are marked dirty in the buffer cache.
  *
  * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
  * sectors of bits, one bit for each sector on the filesystem. The
@@ -73,6 +90,7 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
 	uint32_t j, freemapblocks;
 	char *freemapdata;
+	struct sfs_buf *buf;
 	int result;
 
 	/* Number of blocks in the free block bitmap. */
@@ -93,8 +111,16 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 					       SFS_BLOCKSIZE);
 		}
 		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+			/* Only the blocks that changed need writing. */
+			result = sfs_bread(sfs, SFS_FREEMAP_START+j, &buf);
+			if (result == 0) {
+				if (!sfs_sameblock(sfs_bdata(buf), ptr)) {
+					memcpy(sfs_bdata(buf), ptr,
+					       SFS_BLOCKSIZE);
+					sfs_bdirty(buf, 0);
+				}
+				sfs_brelse(buf);
+			}
 		}
 
 		/* If we failed, stop. */
@@ -106,21 +132,68 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 }
 
 /*
- * Sync routine for the vnode table.
+ * Sync routine for the vnode table. This only copies the dirty inodes
+ * into the buffer cache; sfs_bsync writes them out.
+ *
+ * The table is only held long enough to take a reference to each
+ * vnode: someone holding a directory lock may be waiting for the
+ * table, so we can't wait for a vnode lock while holding it.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct vnodearray *snap;
+	struct sfs_vnode *sv;
+	unsigned i, h, num;
+	int result;
+
+	snap = vnodearray_create();
+	if (snap == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	result = vnodearray_setsize(snap, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(snap);
+		return result;
+	}
+	i = 0;
+	for (h=0; h<sfs->sfs_vnbuckets; h++) {
+		for (sv = sfs->sfs_vnodes[h]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			if (sv->sv_busy) {
+				/* not loaded yet, or reclaim syncs it */
+				continue;
+			}
+			VOP_INCREF(&sv->sv_absvn);
+			vnodearray_set(snap, i++, &sv->sv_absvn);
+		}
+	}
+	KASSERT(i <= num);
+	num = i;
+	lock_release(sfs->sfs_vnlock);
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* Go over the loaded vnodes, syncing as we go. */
+	result = 0;
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		struct vnode *v = vnodearray_get(snap, i);
+
+		sv = v->vn_data;
+		if (result == 0) {
+			lock_acquire(sv->sv_lock);
+			result = sfs_sync_inode(sv);
+			lock_release(sv->sv_lock);
+		}
+		VOP_DECREF(v);
 	}
-	return 0;
+
+	vnodearray_setsize(snap, 0);
+	vnodearray_destroy(snap);
+	return result;
 }
 
 /*
@@ -132,17 +205,44 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
 
+/*
+ * Write the freemap out to disk, for fsync: blocks a file has just
+ * been given are still free after a crash unless the freemap that
+ * says otherwise got there too.
+ */
+int
+sfs_writefreemap(struct sfs_fs *sfs)
+{
+	uint32_t j;
+	int result;
+
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+	for (j=0; j<SFS_FS_FREEMAPBLOCKS(sfs); j++) {
+		result = sfs_bwrite(sfs, SFS_FREEMAP_START+j);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
 /*
  * Sync routine for the superblock.
  */
@@ -152,14 +252,48 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
+	return 0;
+}
+
+/*
+ * Copy all the metadata that is dirty in memory (inodes, freemap,
+ * superblock) into the buffer cache. This is the first half of a
+ * sync; the syncer thread does it once a second on its own.
+ */
+int
+sfs_writemeta(struct sfs_fs *sfs)
+{
+	int result;
+
+	/* If any vnodes need to be written, write them. */
+	result = sfs_sync_vnodes(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* If the free block map needs to be written, write it. */
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* If the superblock needs to be written, write it. */
+	result = sfs_sync_superblock(sfs);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -174,8 +308,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -208,28 +340,18 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* If any vnodes need to be written, write them. */
-	result = sfs_sync_vnodes(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
-	}
-
-	/* If the free block map needs to be written, write it. */
-	result = sfs_sync_freemap(sfs);
+	/* Get the dirty inodes, freemap and superblock into the cache. */
+	result = sfs_writemeta(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* If the superblock needs to be written, write it. */
-	result = sfs_sync_superblock(sfs);
+	/* Now write back whatever is dirty in the buffer cache. */
+	result = sfs_bsync(sfs, 0);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -243,13 +365,8 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* The volume name never changes while mounted */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -259,10 +376,16 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	/* Nothing dirty is left by now; just get rid of the buffers */
+	sfs_bpurge(sfs);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnodes);
+	lock_destroy(sfs->sfs_freemaplock);
+	cv_destroy(sfs->sfs_vncv);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,19 +400,26 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-
-	vfs_biglock_acquire();
+	int result;
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Write back the buffer cache while there's still a device. */
+	result = sfs_bpurge(sfs);
+	if (result) {
+		return result;
+	}
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,7 +427,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -351,17 +480,41 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
+	sfs->sfs_vnbuckets = SFS_VNBUCKETS;
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_vnodes = kmalloc(SFS_VNBUCKETS * sizeof(sfs->sfs_vnodes[0]));
 	if (sfs->sfs_vnodes == NULL) {
 		goto cleanup_object;
 	}
+	bzero(sfs->sfs_vnodes, SFS_VNBUCKETS * sizeof(sfs->sfs_vnodes[0]));
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_vnodes;
+	}
+	sfs->sfs_vncv = cv_create("sfs vnodes");
+	if (sfs->sfs_vncv == NULL) {
+		goto cleanup_vnlock;
+	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vncv;
+	}
+
+	/* not on the syncer's list yet */
+	sfs->sfs_next = NULL;
 
 	return sfs;
 
+cleanup_vncv:
+	cv_destroy(sfs->sfs_vncv);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
+cleanup_vnodes:
+	kfree(sfs->sfs_vnodes);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,8 +541,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -402,7 +553,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,10 +560,12 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
+	/* Make sure the buffer cache is ready */
+	sfs_bbootstrap();
+
 	/* Set the device so we can use sfs_readblock() */
 	sfs->sfs_device = dev;
 
@@ -423,7 +575,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,7 +587,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -453,21 +603,21 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (sfs->sfs_freemap == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* From now on the syncer looks after it */
+	sfs_bmount(sfs);
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -35,26 +35,146 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Define SFS_CHECKED to have sfs_loadvnode check that every vnode it
+ * looks at is in an allocated block. Each check takes the freemap
+ * lock, so it is off by default.
+ */
+#undef SFS_CHECKED
+
+////////////////////////////////////////////////////////////
+// Vnode table
+//
+// The loaded vnodes of an sfs are kept in a hash table keyed by inode
+// number, sfs_vnodes, with sfs_vnbuckets chains linked through
+// sv_hashnext. It doubles when there are more vnodes than chains, so
+// the chains stay short however many files are open. Call these with
+// sfs_vnlock held.
+
+static
+unsigned
+sfs_vnhash(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino & (sfs->sfs_vnbuckets - 1);
+}
+
+static
+struct sfs_vnode *
+sfs_vnlookup(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnodes[sfs_vnhash(sfs, ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+#ifdef SFS_CHECKED
+		/* Every inode in memory must be in an allocated block */
+		if (!sv->sv_busy && !sfs_bused(sfs, sv->sv_ino)) {
+			panic("sfs: %s: Found inode %u in unallocated block\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+#endif
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Double the table. If there's no memory for that, the chains just
+ * get longer.
+ */
+static
+void
+sfs_vngrow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newtab, **oldtab, *sv;
+	unsigned i, oldsize;
+
+	oldsize = sfs->sfs_vnbuckets;
+	newtab = kmalloc(2 * oldsize * sizeof(newtab[0]));
+	if (newtab == NULL) {
+		return;
+	}
+	bzero(newtab, 2 * oldsize * sizeof(newtab[0]));
+
+	oldtab = sfs->sfs_vnodes;
+	sfs->sfs_vnodes = newtab;
+	sfs->sfs_vnbuckets = 2 * oldsize;
+	for (i=0; i<oldsize; i++) {
+		while ((sv = oldtab[i]) != NULL) {
+			oldtab[i] = sv->sv_hashnext;
+			sv->sv_hashnext = newtab[sfs_vnhash(sfs, sv->sv_ino)];
+			newtab[sfs_vnhash(sfs, sv->sv_ino)] = sv;
+		}
+	}
+	kfree(oldtab);
+}
+
+static
+void
+sfs_vninsert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+
+	if (sfs->sfs_nvnodes >= sfs->sfs_vnbuckets) {
+		sfs_vngrow(sfs);
+	}
+	h = sfs_vnhash(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnodes[h];
+	sfs->sfs_vnodes[h] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	svp = &sfs->sfs_vnodes[sfs_vnhash(sfs, sv->sv_ino)];
+	while (*svp != sv) {
+		if (*svp == NULL) {
+			panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+		svp = &(*svp)->sv_hashnext;
+	}
+	*svp = sv->sv_hashnext;
+	sfs->sfs_nvnodes--;
+}
+
+////////////////////////////////////////////////////////////
+// Inodes
+
+
+/*
+ * Write an on-disk inode structure back to its buffer. It is dirtied
+ * for the file itself, so sfs_bsync on the file writes it out too.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		KASSERT(sizeof(sv->sv_i) == SFS_BLOCKSIZE);
+		result = sfs_bget(sfs, sv->sv_ino, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(sfs_bdata(buf), &sv->sv_i, sizeof(sv->sv_i));
+		sfs_bdirty(buf, sv->sv_ino);
+		sfs_brelse(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
@@ -70,10 +190,9 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
@@ -88,25 +207,33 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/*
+	 * It stays in the table, busy, until the inode is written, so
+	 * sfs_loadvnode waits rather than reading the old one from disk.
+	 */
+	KASSERT(!sv->sv_busy);
+	sv->sv_busy = true;
+	lock_release(sfs->sfs_vnlock);
+
+	lock_acquire(sv->sv_lock);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
-			return result;
+			goto fail;
 		}
 	}
 
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto fail;
 	}
 
 	/* If there are no on-disk references, discard the inode */
@@ -114,32 +241,30 @@ sfs_reclaim(struct vnode *v)
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnremove(sfs, sv);
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
 
 	vnode_cleanup(&sv->sv_absvn);
-
-	vfs_biglock_release();
+	lock_destroy(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
 
 	/* Done */
 	return 0;
+
+ fail:
+	lock_release(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_busy = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+	return result;
 }
 
 /*
@@ -150,45 +275,49 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	lock_acquire(sfs->sfs_vnlock);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
-		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+	/* Look in the vnodes table, waiting out loads and reclaims */
+	while ((sv = sfs_vnlookup(sfs, ino)) != NULL && sv->sv_busy) {
+		cv_wait(sfs->sfs_vncv, sfs->sfs_vnlock);
+	}
+	if (sv != NULL) {
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
-	/* Didn't have it loaded; load it */
+	/*
+	 * Didn't have it loaded; load it. It goes into the table busy
+	 * first, so nobody else loads it too while we read it in.
+	 */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_ino = ino;
+	sv->sv_busy = true;
+	sfs_vninsert(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+
 	/* Must be in an allocated block */
 	if (!sfs_bused(sfs, ino)) {
 		panic("sfs: %s: Tried to load inode %u from "
@@ -198,8 +327,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
 
 	/* Not dirty yet */
@@ -235,24 +363,27 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
 
-	/* Set the other fields in our vnode structure */
-	sv->sv_ino = ino;
-
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	/* Ready; let anyone waiting for it have it */
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_busy = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
 	return 0;
+
+ fail:
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnremove(sfs, sv);
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+	return result;
 }
 
 /*
@@ -296,25 +427,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
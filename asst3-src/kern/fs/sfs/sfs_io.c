@@ -36,6 +36,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -53,17 +54,15 @@
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read or write a block, retrying I/O errors. This goes straight to
+ * the disk; everything else goes through the buffer cache.
  */
-static
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -102,33 +101,45 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block, through the buffer cache.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bread(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, sfs_bdata(buf), SFS_BLOCKSIZE);
+	sfs_brelse(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block. This only updates the buffer cache; the block goes
+ * to disk when the cache is synced or needs the buffer back.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bget(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(sfs_bdata(buf), data, SFS_BLOCKSIZE);
+	sfs_bdirty(buf, 0);
+	sfs_brelse(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,14 +161,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
+	struct sfs_buf *buf;
+	char *iobuf;
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t diskblock;
@@ -169,8 +174,8 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* The block map had better be locked */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -184,40 +189,33 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Read the block.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_bread(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	iobuf = sfs_bdata(buf);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * UIO is in the kernel (see sfs_rdwr), so this can't fault.
 	 */
+	result = uiomove(iobuf+skipstart, len, uio);
+
+	/* If it was a write, the buffer now differs from the disk */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		sfs_bdirty(buf, sv->sv_ino);
 	}
 
-	return 0;
+	sfs_brelse(buf);
+	return result;
 }
 
 /*
@@ -228,14 +226,14 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -257,37 +255,105 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(sfs_bdata(buf), SFS_BLOCKSIZE, uio);
+		sfs_brelse(buf);
+		return result;
+	}
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * A whole block is being written, so there is no need to read
+	 * the old one; fill a fresh buffer straight from UIO.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	result = sfs_bget(sfs, diskblock, &buf);
+	if (result) {
+		return result;
+	}
+	result = uiomove(sfs_bdata(buf), SFS_BLOCKSIZE, uio);
+	sfs_bdirty(buf, sv->sv_ino);
+	sfs_brelse(buf);
+	return result;
+}
 
-	result = sfs_rwblock(sfs, uio);
+/*
+ * Read-ahead window limits, in blocks.
+ */
+#define SFS_RAMIN	4
+#define SFS_RAMAX	32
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+/*
+ * Read ahead for an open file that just read from START to END,
+ * according to its read-ahead state RA. A read that starts where the
+ * last one ended is sequential and doubles the window, up to
+ * SFS_RAMAX; anything else closes it. Blocks from where the last
+ * read-ahead stopped to a window past END are queued for the
+ * read-ahead thread, so each block is asked for once.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, struct uio_readahead *ra,
+	      off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t blocks[SFS_RAMAX];
+	daddr_t diskblock;
+	uint32_t fileblock, endblock;
+	off_t from, to;
+	unsigned n;
+
+	if (start != ra->ra_next) {
+		/* Not sequential (or seeked); stop reading ahead. */
+		ra->ra_next = end;
+		ra->ra_ahead = 0;
+		ra->ra_window = 0;
+		return;
+	}
+	ra->ra_next = end;
+	if (ra->ra_window == 0) {
+		ra->ra_window = SFS_RAMIN;
+	}
+	else if (ra->ra_window < SFS_RAMAX) {
+		ra->ra_window *= 2;
+	}
 
-	return result;
+	from = end > ra->ra_ahead ? end : ra->ra_ahead;
+	to = end + (off_t)ra->ra_window * SFS_BLOCKSIZE;
+	if (to > (off_t)sv->sv_i.sfi_size) {
+		to = sv->sv_i.sfi_size;
+	}
+	if (from >= to) {
+		return;
+	}
+	ra->ra_ahead = to;
+
+	/* The block END is in was just read; start after it. */
+	n = 0;
+	endblock = DIVROUNDUP(to, SFS_BLOCKSIZE);
+	for (fileblock = DIVROUNDUP(from, SFS_BLOCKSIZE);
+	     fileblock < endblock && n < SFS_RAMAX; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			/* holes read as zeros without any I/O */
+			blocks[n++] = diskblock;
+		}
+	}
+	if (n > 0) {
+		sfs_bprefetch(sfs, ra->ra_window, blocks, n);
+	}
 }
 
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * The vnode is locked and UIO points into the kernel; sfs_rdwr sets
+ * that up.
  */
+static
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
@@ -295,8 +361,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origoffset;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
 
 	origresid = uio->uio_resid;
+	origoffset = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -381,6 +452,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/* If it was a read() of an open file, see about reading ahead */
+	if (result == 0 && uio->uio_ra != NULL) {
+		KASSERT(uio->uio_rw == UIO_READ);
+		sfs_readahead(sv, uio->uio_ra, origoffset, uio->uio_offset);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -388,6 +465,118 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+/*
+ * Copy LEN bytes in from UIO (a write from one buffer) without moving
+ * UIO: it only moves on by what actually gets written.
+ */
+static
+int
+sfs_copyin(struct uio *uio, void *buf, size_t len)
+{
+	struct iovec iov;
+	struct uio shadow;
+
+	KASSERT(uio->uio_iovcnt == 1);
+	iov = *uio->uio_iov;
+	shadow = *uio;
+	shadow.uio_iov = &iov;
+	return uiomove(buf, len, &shadow);
+}
+
+/*
+ * Move UIO (one buffer) on by LEN bytes that were written.
+ */
+static
+void
+sfs_uioskip(struct uio *uio, size_t len)
+{
+	KASSERT(uio->uio_iovcnt == 1);
+	KASSERT(len <= uio->uio_iov->iov_len && len <= uio->uio_resid);
+	uio->uio_iov->iov_ubase += len;
+	uio->uio_iov->iov_len -= len;
+	uio->uio_offset += len;
+	uio->uio_resid -= len;
+}
+
+/*
+ * File read and write. The vnode is locked for the whole transfer, so
+ * a read() or write() is atomic with respect to the others on the
+ * file. A uiomove to or from user space can fault, and the fault can
+ * come back into sfs to read this file or another one (a mapping, or
+ * program text), so user data goes through a kernel bounce buffer:
+ * copied in before the vnode is locked, or out after it is unlocked.
+ * Blocks are only allocated once the data is in hand, so a bad user
+ * pointer allocates nothing.
+ *
+ * The bounce buffer holds the whole transfer if there is memory for
+ * it; if not, the transfer is done in smaller pieces, each atomic.
+ */
+int
+sfs_rdwr(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *bounce;
+	size_t chunk, len, done;
+	int result;
+
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		/* the page cache, swap and the like; this can't fault */
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	chunk = uio->uio_resid;
+	while ((bounce = kmalloc(chunk)) == NULL) {
+		if (chunk <= SFS_BLOCKSIZE) {
+			return ENOMEM;
+		}
+		chunk = chunk / 2;
+	}
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid < chunk ? uio->uio_resid : chunk;
+		uio_kinit(&iov, &ku, bounce, len, uio->uio_offset,
+			  uio->uio_rw);
+
+		if (uio->uio_rw == UIO_READ) {
+			ku.uio_ra = uio->uio_ra;
+			lock_acquire(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			lock_release(sv->sv_lock);
+			done = len - ku.uio_resid;
+			if (result == 0) {
+				result = uiomove(bounce, done, uio);
+			}
+		}
+		else {
+			result = sfs_copyin(uio, bounce, len);
+			if (result) {
+				break;
+			}
+			lock_acquire(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			lock_release(sv->sv_lock);
+			done = len - ku.uio_resid;
+			sfs_uioskip(uio, done);
+		}
+		if (result || done < len) {
+			/* error, or end of file */
+			break;
+		}
+	}
+
+	kfree(bounce);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 // Metadata I/O
 
@@ -413,18 +602,11 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	daddr_t diskblock;
 	bool doalloc;
 	int result;
+	struct sfs_buf *buf;
+	char *metaiobuf;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* The block map had better be locked */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -446,26 +628,23 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block from the buffer cache */
+	result = sfs_bread(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	metaiobuf = sfs_bdata(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
 		memcpy(data, metaiobuf + blockoffset, len);
+		sfs_brelse(buf);
 	}
 	else {
 		/* Update the selected region */
 		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		sfs_bdirty(buf, sv->sv_ino);
+		sfs_brelse(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -41,12 +41,31 @@ extern const struct vnode_ops sfs_dirops;
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
+/* Initial size of the vnode table (struct sfs_fs); must be a power of 2 */
+#define SFS_VNBUCKETS 32
+
 
 /* Functions in sfs_balloc.c */
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
+/* Functions in sfs_buf.c */
+struct sfs_buf;
+void sfs_bbootstrap(void);
+void sfs_bmount(struct sfs_fs *sfs);
+int sfs_bread(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+int sfs_bget(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+void *sfs_bdata(struct sfs_buf *buf);
+void sfs_bdirty(struct sfs_buf *buf, uint32_t ino);
+void sfs_brelse(struct sfs_buf *buf);
+int sfs_bsync(struct sfs_fs *sfs, uint32_t ino);
+int sfs_bwrite(struct sfs_fs *sfs, daddr_t block);
+void sfs_bprefetch(struct sfs_fs *sfs, unsigned window,
+		const daddr_t *blocks, unsigned nblocks);
+void sfs_bdrop(struct sfs_fs *sfs, daddr_t block);
+int sfs_bpurge(struct sfs_fs *sfs);
+
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
@@ -62,6 +81,10 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_writemeta(struct sfs_fs *sfs);
+int sfs_writefreemap(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
@@ -71,9 +94,10 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
-int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+int sfs_rdwr(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
@@ -35,10 +35,12 @@
  */
 
 
+#include <spinlock.h>
 #include <vm.h>
 //#include "opt-dumbvm.h"
 
 struct vnode;
+struct rlimit;
 
 
 /*
@@ -59,16 +61,78 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-        region * head_region;//region list
+        //regions, sorted by vbase and not overlapping, so a fault
+        //can find its region by binary search
+        region *regions;
+        unsigned nregions;
+        unsigned maxregions;
+        //index of the region the last lookup found, faults tend to
+        //come in runs in the same region
+        unsigned lastregion;
+        //the heap runs from heap_start to the break, heap_end. while
+        //it isn't empty it is the region starting at heap_start
+        vaddr_t heap_start;
+        vaddr_t heap_end;
+        //the stack may grow down to USERSTACK - stack_limit, nothing
+        //else is put there. it is RLIMIT_STACK's soft limit rounded
+        //up to pages; as_stackcur and as_stackmax are the soft and
+        //hard limits as set
+        size_t stack_limit;
+        rlim_t as_stackcur;
+        rlim_t as_stackmax;
+        //fault-around: the page of the last fault, and how many pages
+        //past it the next fault maps, see vm_fault. hints only
+        vaddr_t fa_last;
+        unsigned fa_window;
         //don't use it now
         //vaddr_t vstackbase;
         char isPrepared; // 0 no 1 yes
         //also we need page table here
         PTE **pagetable;
+        //protects the page table entries, the pager changes them
+        //from other threads when it evicts a page
+        struct spinlock as_ptlock;
+        //one bit per first-level slot, set while the second-level
+        //table is shared with other address spaces since fork.
+        //nobody writes PTEs in a shared table, it's split first
+        uint32_t as_l2shared[1024 / 32];
+        //pages of ours the pager is writing out right now, fork waits
+        //for them so it doesn't share a table that is about to change
+        //(frame_lock)
+        unsigned as_pageouts;
+        //ASID on each cpu, see vm_tlb_activate
+        uint32_t *as_asids;
+        unsigned as_lastcpu;
+        //resident set: pages our PTEs map, and the most there have
+        //been (as_ptlock). a page in a table shared since fork counts
+        //for every address space sharing it
+        unsigned as_rss;
+        unsigned as_rsspeak;
+        //RLIMIT_RSS as set by setrlimit (soft and hard, in bytes),
+        //and the soft limit in pages. at the limit our faults replace
+        //our own pages
+        rlim_t as_rsscur;
+        rlim_t as_rssmax;
+        unsigned as_rsscap;
+        //where local replacement looks for a victim next
+        vaddr_t as_rsshand;
+        //faults, and those that read the page from swap or a file
+        unsigned as_faults;
+        unsigned as_majflt;
+        //second-level tables freed because they were left empty
+        unsigned as_l2freed;
 
 #endif
 };
 
+//as_rsscap without an RSS limit, and the least it can be
+#define RSSCAP_NONE  0xffffffff
+#define RSSCAP_MIN   16
+
+#define PT_L2_ISSHARED(as, i)   (((as)->as_l2shared[(i) / 32] >> ((i) % 32)) & 1)
+#define PT_L2_SETSHARED(as, i)  ((as)->as_l2shared[(i) / 32] |= 1U << ((i) % 32))
+#define PT_L2_CLRSHARED(as, i)  ((as)->as_l2shared[(i) / 32] &= ~(1U << ((i) % 32)))
+
 /*
  * Functions in addrspace.c:
  *
@@ -105,6 +169,62 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                The stack starts out one page long.
+ *
+ *    as_grow_stack - VADDR isn't in any region; if it is below the
+ *                stack but within the stack limit, grow the stack down
+ *                to it and return the stack region, else return NULL.
+ *
+ *    as_find_region - return the region VADDR is in, or NULL if it
+ *                isn't in any. O(log n) in the number of regions.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes, handing back
+ *                the old end in OLDBREAK. Fails with EINVAL if that
+ *                would move it below the start, or ENOMEM if it would
+ *                run into another region.
+ *
+ *    as_define_file - have the region at VADDR filled on demand from
+ *                FILESIZE bytes of vnode V at OFFSET, which belong at
+ *                VADDR. Fails with EEXIST if the region already has
+ *                data from another file segment (two segments share a
+ *                page); that segment then has to be loaded up front.
+ *
+ *    as_mmap   - map LENGTH bytes of vnode V from OFFSET (page-aligned)
+ *                shared, read-only or WRITEABLE, at an address of the
+ *                kernel's choosing, handed back in ADDR. Fails with
+ *                ENOMEM if there is no room between the heap and the
+ *                stack.
+ *
+ *    as_munmap - remove the mapping starting at ADDR and write back the
+ *                file pages it dirtied. Fails with EINVAL if no mapping
+ *                starts there.
+ *
+ *    as_sync_file - for fsync: mark AS's mappings of V clean, so that
+ *                writing the page cache back leaves them clean.
+ *
+ *    as_ptstats - count AS's second-level tables, how many of them are
+ *                shared since fork, and their entries that aren't 0.
+ *
+ *    as_madvise - apply madvise hint ADVICE to [ADDR, ADDR+LEN). The
+ *                access hints (NORMAL, RANDOM, SEQUENTIAL) apply to
+ *                each whole region the range touches. Fails with
+ *                EINVAL for an unaligned ADDR or unknown ADVICE, or
+ *                ENOMEM if part of the range isn't mapped.
+ *
+ *    as_rss_inc - count one more resident page. Call with as_ptlock
+ *                held.
+ *
+ *    as_setrlimit_rss - set RLIMIT_RSS. Fails with EINVAL if the soft
+ *                limit is above the hard one, or EPERM if the hard
+ *                limit would go up.
+ *
+ *    as_setrlimit_stack - set RLIMIT_STACK. Fails with EINVAL if the
+ *                soft limit is above the hard one or below what the
+ *                stack already takes up (and at least a page), EPERM
+ *                if the hard limit would go up, or ENOMEM if another
+ *                region is in the way of the new soft limit.
+ *
+ *    as_copy_limits - give TO the resource limits of FROM, for exec.
  *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
@@ -124,6 +244,29 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+region           *as_find_region(struct addrspace *as, vaddr_t vaddr);
+region           *as_grow_stack(struct addrspace *as, vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
+int               as_mmap(struct addrspace *as, size_t length,
+                          bool writeable, struct vnode *v, off_t offset,
+                          vaddr_t *addr);
+int               as_munmap(struct addrspace *as, vaddr_t addr);
+void              as_sync_file(struct addrspace *as, struct vnode *v);
+void              as_ptstats(struct addrspace *as, unsigned *tables,
+                             unsigned *shared, unsigned *live);
+int               as_madvise(struct addrspace *as, vaddr_t addr,
+                             size_t len, int advice);
+void              as_rss_inc(struct addrspace *as);
+int               as_setrlimit_rss(struct addrspace *as,
+                                   const struct rlimit *rl);
+int               as_setrlimit_stack(struct addrspace *as,
+                                     const struct rlimit *rl);
+void              as_copy_limits(struct addrspace *from,
+                                 struct addrspace *to);
 
 
 /*
@@ -33,7 +33,7 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
-#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX, FRAMECACHE_MAX */
 
 
 /*
@@ -62,6 +62,35 @@ struct cpu {
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * c_frames[] is a magazine of up to FRAMECACHE_MAX free page
+	 * frames that this cpu can hand out without taking the global
+	 * frame table lock. See vm/frametable.c. The counters are for
+	 * statistics and may be read (racily) by other cpus.
+	 */
+	paddr_t c_frames[FRAMECACHE_MAX];
+	unsigned c_numframes;		/* Frames in c_frames[] */
+	unsigned c_frame_hits;		/* Allocations served from c_frames */
+	unsigned c_frame_refills;	/* Batches taken from the frame table */
+	unsigned c_frame_drains;	/* Batches given back to it */
+	unsigned c_vm_faults;		/* Calls to vm_fault on this cpu */
+	uint64_t c_vm_faultns;		/* ...and nanoseconds spent in them */
+	unsigned c_fa_mapped;		/* Pages mapped by fault-around */
+	unsigned c_fa_preloaded;	/* TLB entries it preloaded */
+	unsigned c_madv_prefetched;	/* Pages brought in for MADV_WILLNEED */
+	unsigned c_madv_dropped;	/* Pages dropped behind MADV_SEQUENTIAL */
+
+	/*
+	 * Address space IDs for TLB entries, handed out by this cpu; see
+	 * vm_tlb_activate in vm/vm.c.
+	 */
+	uint32_t c_asid_gen;		/* Current ASID generation */
+	unsigned c_asid_next;		/* Next free ASID in this generation */
+	uint32_t c_asid_cur;		/* TLBHI_PID of the running address space */
+	unsigned c_as_activates;	/* Address space activations */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -107,6 +136,14 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Iterate over the cpus, e.g. to collect per-cpu statistics.
+ * cpu_count returns the number of cpus; cpu_get returns the cpu with
+ * software number NUM.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -35,6 +35,7 @@
 #define _OPENFILE_H_
 
 #include <spinlock.h>
+#include <uio.h> /* for uio_readahead */
 
 
 /*
@@ -52,8 +53,9 @@ struct openfile {
 	struct vnode *of_vnode;
 	int of_accmode;	/* from open: O_RDONLY, O_WRONLY, or O_RDWR */
 
-	struct lock *of_offsetlock;	/* lock for of_offset */
+	struct lock *of_offsetlock;	/* lock for of_offset and of_ra */
 	off_t of_offset;
+	struct uio_readahead of_ra;	/* for the file system's read-ahead */
 
 	struct spinlock of_reflock;	/* lock for of_refcount */
 	int of_refcount;
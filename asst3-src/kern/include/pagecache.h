@@ -0,0 +1,64 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for file mappings (mmap) and program text. Pages are
+ * named by vnode and page-aligned file offset, and every mapping of
+ * the same file page uses the same frame.
+ *
+ *    pc_bootstrap   - set up the page cache.
+ *    pc_getpage     - find page OFFSET of V, reading it in if it isn't
+ *                     cached, and count one more mapping of it. WRITE
+ *                     says the new mapping is dirty.
+ *    pc_trypage     - same, read-only, but only if the page is cached
+ *                     and ready; never reads or sleeps. Returns false
+ *                     if it isn't.
+ *    pc_dup         - one more PTE maps PC (a page table was copied).
+ *    pc_unmap       - one PTE less maps PC; DIRTY if it had PTE_DIRTY.
+ *                     The page stays cached with no mappings until
+ *                     pc_reclaim takes its frame.
+ *    pc_dirty       - a PTE mapping PC got PTE_DIRTY.
+ *    pc_clean       - a PTE mapping PC lost PTE_DIRTY (fsync).
+ *    pc_invalidate  - write() changed V between OFFSET and OFFSET+LEN:
+ *                     forget the clean pages there that nobody maps.
+ *                     Mapped pages keep what they had. write() calls
+ *                     pc_flush on the range first, so no dirty page
+ *                     there is written back over the new data later.
+ *    pc_truncate    - V was truncated to nothing: forget every page of
+ *                     it, dirty or not. Mapped pages stay mapped with
+ *                     what they had but are never written back.
+ *    pc_flush       - write back the dirty cached pages of V between
+ *                     OFFSET and OFFSET+LEN.
+ *    pc_sync        - write back all dirty cached pages of V, or of
+ *                     every file if V is NULL.
+ *    pc_reclaim     - drop the least recently unmapped page nobody
+ *                     maps, writing it back if it is dirty, and hand
+ *                     back its frame. Returns 0 if there is none.
+ *    pc_shutdown    - write back and drop every page nobody maps, so
+ *                     the file systems can be unmounted.
+ *    pc_printstats  - print hit and write-back counts.
+ *
+ * A page counts as dirty from the time any mapping of it is first
+ * written until it is written back with no mapping still dirty.
+ */
+
+struct vnode;
+struct pcpage;
+
+void pc_bootstrap(void);
+int pc_getpage(struct vnode *v, off_t offset, bool write, paddr_t *ret);
+bool pc_trypage(struct vnode *v, off_t offset, paddr_t *ret);
+void pc_dup(struct pcpage *pc, bool dirty);
+void pc_unmap(struct pcpage *pc, bool dirty);
+void pc_dirty(struct pcpage *pc);
+void pc_clean(struct pcpage *pc);
+void pc_invalidate(struct vnode *v, off_t offset, off_t len);
+void pc_truncate(struct vnode *v);
+int pc_flush(struct vnode *v, off_t offset, off_t len);
+int pc_sync(struct vnode *v);
+paddr_t pc_reclaim(void);
+void pc_shutdown(void);
+void pc_printstats(void);
+
+
+#endif /* _PAGECACHE_H_ */
@@ -65,6 +65,8 @@ struct proc {
 	struct vnode *p_cwd;		/* current working directory */
 	struct filetable *p_filetable;	/* table of open files */
 
+	struct proc *p_next;		/* all-processes list (allprocs_lock) */
+
 	/* add more material here as needed */
 };
 
@@ -107,5 +109,11 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/* Print the resident set of every user process. */
+void proc_printmem(void);
+
+/* Print the page table size of every user process. */
+void proc_printpt(void);
+
 
 #endif /* _PROC_H_ */
@@ -50,12 +50,25 @@
 
 /*
  * In-memory inode
+ *
+ * sv_lock covers sv_i, sv_dirty and the file's blocks (data,
+ * directory entries, indirect block). Locking order: a directory's
+ * sv_lock, then sfs_vnlock, then a file's sv_lock, then
+ * sfs_freemaplock. Nobody holds an sv_lock across a uiomove to or
+ * from user space, which can fault and come back into sfs.
+ *
+ * sfs_vnlock is never held across I/O. A vnode being read in or
+ * reclaimed stays in the table with sv_busy set, and whoever looks
+ * it up meanwhile waits on sfs_vncv.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct lock *sv_lock;           /* lock for the inode and data */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	bool sv_busy;                   /* being loaded or reclaimed */
+	struct sfs_vnode *sv_hashnext;  /* vnode table chain */
 };
 
 /*
@@ -66,9 +79,16 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct cv *sfs_vncv;            /* wait for a vnode to stop being busy */
+	struct sfs_vnode **sfs_vnodes;  /* vnodes loaded into memory,
+					   hashed by inode number */
+	unsigned sfs_vnbuckets;         /* size of sfs_vnodes */
+	unsigned sfs_nvnodes;           /* vnodes in it */
+	struct lock *sfs_freemaplock;   /* lock for freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct sfs_fs *sfs_next;        /* mounted sfs list (sfs_buf.c) */
 };
 
 /*
@@ -76,5 +96,10 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print the buffer cache statistics (sfs_buf.c)
+ */
+void sfs_printstats(void);
+
 
 #endif /* _SFS_H_ */
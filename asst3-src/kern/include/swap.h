@@ -0,0 +1,29 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space, used by the pager in frametable.c.
+ *
+ *    swap_bootstrap - open the swap device. If it isn't there the
+ *                     system runs without swap.
+ *    swap_enabled   - true if there is a swap device.
+ *    swap_out       - write the frame at PADDR to a newly allocated
+ *                     slot and hand back the slot number.
+ *    swap_in        - read slot SLOT into the frame at PADDR. The
+ *                     slot stays allocated.
+ *    swap_dup       - add a reference to a slot, for fork.
+ *    swap_free      - drop a reference to a slot, releasing it when
+ *                     the last one goes.
+ *    swap_printstats - print slot usage and page-in/page-out counts.
+ */
+
+void swap_bootstrap(void);
+bool swap_enabled(void);
+int swap_out(paddr_t paddr, unsigned *slot);
+int swap_in(unsigned slot, paddr_t paddr);
+void swap_dup(unsigned slot);
+void swap_free(unsigned slot);
+void swap_printstats(void);
+
+
+#endif /* _SWAP_H_ */
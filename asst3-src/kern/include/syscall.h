@@ -77,9 +77,20 @@ int sys_close(int fd);
 int sys_read(int fd, userptr_t buf, size_t size, int *retval);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
 int sys_lseek(int fd, off_t offset, int code, off_t *retval);
+int sys_fsync(int fd);
 
 int sys_chdir(const_userptr_t path);
 int sys___getcwd(userptr_t buf, size_t buflen, int *retval);
 
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(size_t length, int prot, int fd, off_t offset,
+	     int32_t *retval);
+int sys_munmap(userptr_t addr);
+int sys_madvise(userptr_t addr, size_t len, int advice);
+
+int sys_getrusage(int who, userptr_t ru);
+int sys_getrlimit(int resource, userptr_t rl);
+int sys_setrlimit(int resource, const_userptr_t rl);
+
 
 #endif /* _SYSCALL_H_ */
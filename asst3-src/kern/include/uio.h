@@ -70,6 +70,18 @@ enum uio_seg {
         UIO_SYSSPACE,			/* Kernel. */
 };
 
+/*
+ * Read-ahead state of an open file. read() passes it along in the uio
+ * so the file system can tell sequential reads of that open file from
+ * others and read ahead of them; the file system keeps it up to date.
+ * It is covered by the open file's offset lock.
+ */
+struct uio_readahead {
+	off_t ra_next;			/* where a sequential read starts */
+	off_t ra_ahead;			/* already read ahead up to here */
+	unsigned ra_window;		/* blocks to read ahead, 0 = none */
+};
+
 struct uio {
 	struct iovec     *uio_iov;	/* Data blocks */
 	unsigned          uio_iovcnt;	/* Number of iovecs */
@@ -78,6 +90,7 @@ struct uio {
 	enum uio_seg      uio_segflg;	/* What kind of pointer we have */
 	enum uio_rw       uio_rw;	/* Whether op is a read or write */
 	struct addrspace *uio_space;	/* Address space for user pointer */
+	struct uio_readahead *uio_ra;	/* Read-ahead state, or NULL */
 };
 
 
@@ -95,7 +108,8 @@ struct uio {
  *   (4) set up uio_seg and uio_rw correctly;
  *   (5) if uio_seg is UIO_SYSSPACE, set uio_space to NULL; otherwise,
  *       initialize uio_space to the address space in which the buffer
- *       should be found.
+ *       should be found;
+ *   (6) set uio_ra to NULL, unless it's a read() of an open file.
  *
  * After calling,
  *   (1) the contents of uio_iov and uio_iovcnt may be altered and
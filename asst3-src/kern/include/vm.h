@@ -44,21 +44,173 @@
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
-struct frame_table_entry * frame_table;
 //each page table entry is a 4bytes data
 typedef uint32_t PTE;
 
+/*
+ * Page table entry layout. The top 20 bits hold the frame's physical
+ * address while the page is resident, or the swap slot number while
+ * it is swapped out. The low 12 bits are flags; PTE_VALID and
+ * PTE_DIRTY are the same bits as TLBLO_VALID and TLBLO_DIRTY. An entry
+ * of 0 means the page has no contents of its own yet (it was never
+ * touched, or was clean and has been dropped).
+ *
+ * PTE_DIRTY is a software bit: pages go into the TLB read-only until
+ * they are written, and the write fault sets it. A resident page that
+ * is not dirty is still the same as its copy in swap (if it has one,
+ * the frame table keeps the slot) or is still zero, so the pager can
+ * drop it without writing it out.
+ */
+#define PTE_FRAME    0xfffff000   /* paddr or swap slot << 12 */
+#define PTE_VALID    0x00000200   /* page is resident */
+#define PTE_DIRTY    0x00000400   /* written since it was last paged in */
+#define PTE_REF      0x00000001   /* referenced since the clock hand passed */
+#define PTE_SWAPPED  0x00000002   /* page is in swap slot PTE_SLOT() */
+#define PTE_BUSY     0x00000004   /* page is being paged out, wait for it */
+#define PTE_COW      0x00000008   /* shared after fork, copy before writing */
+#define PTE_SLOT(pte)   ((pte) >> 12)
+
+//index into first and second level of the page table
+#define PT_L1_INDEX(vaddr) ((vaddr) >> 22)
+#define PT_L2_INDEX(vaddr) (((vaddr) >> 12) & 0x3ff)
+
+struct addrspace;
+struct vnode;
+struct pcpage;
+
+//a region of the address space, permission is PF_R/PF_W/PF_X.
+//a region loaded from an executable remembers where in the file its
+//data is: the FILESIZE bytes at FILEOFFSET belong at FILEVADDR, and
+//pages are read in when they are first touched. anything else in the
+//region is zero.
+//a region made by mmap is shared: its pages are the file's pages in
+//the page cache, from FILEOFFSET on, and writes go back to the file
+//ADVICE is the last madvise hint for the region, MADV_NORMAL if none
 typedef struct region_element{
     vaddr_t vbase;
     size_t npages;
     int permission;
-    struct region_element * next;
+    struct vnode *vnode;   //NULL if not backed by a file
+    off_t fileoffset;
+    vaddr_t filevaddr;
+    size_t filesize;
+    bool shared;
+    int advice;
 } region;
 
+//madvise hints, the same as in userland <unistd.h>
+#define MADV_NORMAL      0
+#define MADV_RANDOM      1
+#define MADV_SEQUENTIAL  2
+#define MADV_WILLNEED    3
+#define MADV_DONTNEED    4
+
 
 // Initialize frame table
 void ft_initialization(void);
 paddr_t get_frame_address(void);
+unsigned ft_free_frames(void);
+void ft_printstats(void);
+
+/*
+ * Zero pool (frametable.c). A kernel thread zeroes free frames while its
+ * cpu is otherwise idle, so that zero-fill faults and alloc_kpages
+ * don't have to.
+ *
+ *    ft_zeropool_start  - start the zeroing thread.
+ *    ft_zeropool_enable - turn the pool on or off (for benchmarking).
+ *                         Turning it off gives its frames back.
+ */
+void ft_zeropool_start(void);
+void ft_zeropool_enable(bool enable);
+
+/*
+ * User page frames (frametable.c). These can be paged out.
+ *
+ *    ft_alloc_upage  - get a frame for page VADDR of AS, evicting
+ *                      another user page if memory is low. The frame
+ *                      comes back busy (it won't be evicted), and
+ *                      zeroed if ZERO. AS's second-level table for
+ *                      VADDR must exist and not be shared, the frame
+ *                      goes on the reverse map as mapped by its PTE.
+ *                      Returns 0 if nothing could be found.
+ *    ft_try_zpage    - same, zeroed, but only if one is at hand: from
+ *                      the zero pool, or free memory if there is plenty.
+ *                      Never pages anything out. For fault-around.
+ *    ft_upage_ready  - the PTE now maps the frame; let it be evicted.
+ *                      SLOT is the swap slot that holds the same data,
+ *                      or -1.
+ *    ft_dirty_pte    - set PTE_DIRTY in *PTE, if it is resident, and
+ *                      let go of the frame's copy in swap.
+ *    ft_clean_pte    - clear PTE_DIRTY in *PTE, which maps a page cache
+ *                      page, after it has been written back.
+ *    ft_alloc_cpage  - get a frame for page cache page PC, evicting if
+ *                      need be. Returns 0 if nothing could be found.
+ *    ft_map_cpage    - make *PTE, AS's PTE for VADDR, map the page cache
+ *                      frame at PADDR that pc_getpage handed back.
+ *                      On failure the page cache mapping is dropped.
+ *    ft_free_cpage   - give back a frame from ft_alloc_cpage.
+ *    ft_free_upage   - give back a frame from ft_alloc_upage that was
+ *                      never mapped.
+ *    ft_wait_pte     - sleep until *PTE is no longer PTE_BUSY.
+ *    ft_release_pte  - clear *PTE and drop its reference to the frame
+ *                      or swap slot it refers to.
+ *    ft_own_table    - TABLE is a new second-level table of AS.
+ *    ft_pte_count    - an entry of the second-level table PTE is in
+ *                      became non-zero (DELTA 1) or 0 again (DELTA -1).
+ *                      Call with the table owner's as_ptlock held.
+ *    ft_table_live   - how many entries of TABLE aren't 0.
+ *    ft_free_table   - free AS's second-level table in slot L1 if it
+ *                      is AS's own and empty. Returns true if it did.
+ *    ft_share_pagetable - for fork: make COPY use the same second-level
+ *                      tables as AS.
+ *    ft_split_table  - give AS its own copy of the shared second-level
+ *                      table in first-level slot L1, with the pages in
+ *                      it copy-on-write.
+ *    ft_release_table - for as_destroy: drop AS's reference to the
+ *                      shared table in slot L1. Returns false if AS
+ *                      turns out to be the only user, and the table has
+ *                      to be freed as usual.
+ *    ft_cow_break    - give AS its own writable copy of the
+ *                      copy-on-write page mapped by *PTE.
+ */
+paddr_t ft_alloc_upage(struct addrspace *as, vaddr_t vaddr, bool zero);
+paddr_t ft_try_zpage(struct addrspace *as, vaddr_t vaddr);
+void ft_upage_ready(paddr_t paddr, int slot);
+void ft_dirty_pte(struct addrspace *as, PTE *pte);
+void ft_clean_pte(struct addrspace *as, PTE *pte);
+paddr_t ft_alloc_cpage(struct pcpage *pc);
+int ft_map_cpage(struct addrspace *as, vaddr_t vaddr, PTE *pte,
+                 paddr_t paddr, bool write);
+void ft_free_cpage(paddr_t paddr);
+void ft_free_upage(paddr_t paddr);
+void ft_wait_pte(struct addrspace *as, PTE *pte);
+void ft_release_pte(struct addrspace *as, PTE *pte);
+void ft_own_table(struct addrspace *as, PTE *table);
+void ft_pte_count(PTE *pte, int delta);
+unsigned ft_table_live(PTE *table);
+bool ft_free_table(struct addrspace *as, unsigned l1);
+void ft_share_pagetable(struct addrspace *as, struct addrspace *copy);
+int ft_split_table(struct addrspace *as, unsigned l1);
+bool ft_release_table(struct addrspace *as, unsigned l1);
+int ft_cow_break(struct addrspace *as, vaddr_t vaddr, PTE *pte);
+
+/*
+ * TLB management. TLB entries are tagged with an address space ID that
+ * each cpu hands out, so switching address spaces doesn't flush the TLB.
+ *
+ *    vm_tlb_activate  - switch this cpu's TLB over to AS.
+ *    vm_tlb_flush_as  - drop every TLB entry of AS, on all cpus.
+ *    vm_tlb_invalidate - remove AS's page VADDR from this cpu's TLB.
+ *    vm_tlb_shootdown_page - same, for every cpu.
+ *    vm_asid_enable   - turn ASIDs on or off; off, every activation
+ *                       flushes the whole TLB. For benchmarking.
+ */
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_flush_as(struct addrspace *as);
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+void vm_tlb_shootdown_page(struct addrspace *as, vaddr_t vaddr);
+void vm_asid_enable(bool enable);
 /* Initialization function */
 void vm_bootstrap(void);
 
@@ -69,6 +221,47 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Fault counters, reported by the vmb and vmstat menu commands */
+unsigned vm_faultcount(void);
+uint64_t vm_faulttime(void);
+unsigned vm_activatecount(void);
+
+/*
+ * Fault-around. After a fault, vm_fault also maps up to a window of
+ * the pages that follow it in the direction the process is moving
+ * through the region, when that is cheap: resident pages, and untouched
+ * anonymous pages that can get a zeroed frame without paging anything
+ * out. With preloading on it loads them into the TLB too, so they
+ * don't fault at all. Each address space has its own window, which
+ * doubles (up to the maximum) each time a fault lands just past the
+ * previous one and halves when one lands anywhere else.
+ *
+ *    vm_faultaround_set   - set the maximum window, in pages (0 turns
+ *                           fault-around off), and whether to preload.
+ *    vm_faultaround_count - pages mapped and TLB entries preloaded
+ *                           ahead of faults so far.
+ */
+#define FAULTAROUND_MAX 16
+void vm_faultaround_set(unsigned maxwindow, bool preload);
+void vm_faultaround_count(unsigned *mapped, unsigned *preloaded);
+
+/*
+ * madvise (see as_madvise). In a MADV_RANDOM region there is no
+ * fault-around. In a MADV_SEQUENTIAL region faults map twice the
+ * maximum window ahead straight away, and the pages a window behind
+ * the previous fault are dropped: unmapped if they are in the page
+ * cache, otherwise left for the pager to take first.
+ *
+ *    vm_willneed      - make pages [START, END) of region R of AS
+ *                       resident now, reading them in if need be.
+ *                       Stops early, without an error, when memory or
+ *                       the RSS limit runs out.
+ *    vm_madvise_count - pages brought in by vm_willneed and dropped
+ *                       behind sequential faults so far.
+ */
+int vm_willneed(struct addrspace *as, region *r, vaddr_t start, vaddr_t end);
+void vm_madvise_count(unsigned *prefetched, unsigned *dropped);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
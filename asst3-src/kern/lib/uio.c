@@ -161,6 +161,7 @@ uio_kinit(struct iovec *iov, struct uio *u,
 	u->uio_segflg = UIO_SYSSPACE;
 	u->uio_rw = rw;
 	u->uio_space = NULL;
+	u->uio_ra = NULL;
 }
 
 /*
@@ -183,4 +184,5 @@ uio_uinit(struct iovec *iov, struct uio *u,
 	u->uio_segflg = UIO_USERSPACE;
 	u->uio_rw = rw;
 	u->uio_space = proc_getas();
+	u->uio_ra = NULL;
 }
@@ -45,6 +45,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <pagecache.h>
 #include <device.h>
 #include <pid.h>
 #include <syscall.h>
@@ -156,6 +157,8 @@ shutdown(void)
 
 	vfs_clearbootfs();
 	vfs_clearcurdir();
+	/* cached file pages hold their files open */
+	pc_shutdown();
 	vfs_unmountall();
 
 	thread_shutdown();
@@ -43,6 +43,9 @@
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <swap.h>
+#include <pagecache.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 
@@ -164,6 +167,239 @@ cmd_prog(int nargs, char **args)
 	return common_prog(nargs, args);
 }
 
+/*
+ * Command for benchmarking the VM system: runs a userlevel program
+ * like "p" and reports how many page faults it took and how fast
+ * they were handled. Try it with /testbin/huge or /testbin/parallelvm.
+ */
+static
+int
+cmd_vmbench(int nargs, char **args)
+{
+	struct timespec before, after, duration;
+	unsigned faults;
+	uint64_t nsecs, rate;
+	int result;
+
+	if (nargs < 2) {
+		kprintf("Usage: vmb program [arguments]\n");
+		return EINVAL;
+	}
+
+	/* drop the leading "vmb" */
+	args++;
+	nargs--;
+
+	faults = vm_faultcount();
+	gettime(&before);
+
+	result = common_prog(nargs, args);
+	if (result) {
+		return result;
+	}
+
+	gettime(&after);
+	faults = vm_faultcount() - faults;
+	timespec_sub(&after, &before, &duration);
+
+	nsecs = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	rate = nsecs == 0 ? 0 : (uint64_t)faults * 1000000000ULL / nsecs;
+
+	kprintf("vmb: %s: %u faults in %llu.%09lu seconds, "
+		"%llu faults/sec, %u frames free\n", args[0], faults,
+		(unsigned long long) duration.tv_sec,
+		(unsigned long) duration.tv_nsec,
+		(unsigned long long) rate, ft_free_frames());
+
+	return 0;
+}
+
+/*
+ * Command for measuring what ASID-tagged TLB entries save: runs a
+ * userlevel program (by default schedpong, which switches between
+ * processes a lot) once with ASIDs turned off, so every address space
+ * switch flushes the TLB, and once with them on. Every TLB miss on a
+ * user address is a vm_fault, so the difference in faults divided by
+ * the number of switches is what each switch saves.
+ */
+static
+int
+cmd_tlbbench(int nargs, char **args)
+{
+	char defprog[] = "/testbin/schedpong";
+	char *defargs[2] = { defprog, NULL };
+	unsigned faults[2], switches[2];
+	int i, result;
+
+	/* drop the leading "tlbb" */
+	args++;
+	nargs--;
+	if (nargs == 0) {
+		args = defargs;
+		nargs = 1;
+	}
+
+	for (i=0; i<2; i++) {
+		vm_asid_enable(i == 1);
+		faults[i] = vm_faultcount();
+		switches[i] = vm_activatecount();
+		result = common_prog(nargs, args);
+		faults[i] = vm_faultcount() - faults[i];
+		switches[i] = vm_activatecount() - switches[i];
+		if (result) {
+			vm_asid_enable(true);
+			return result;
+		}
+		kprintf("tlbb: ASIDs %s: %u faults, %u switches, "
+			"%u.%02u faults/switch\n", i ? "on" : "off",
+			faults[i], switches[i],
+			switches[i] ? faults[i] / switches[i] : 0,
+			switches[i] ? faults[i] * 100 / switches[i] % 100 : 0);
+	}
+
+	if (faults[0] > faults[1] && switches[0] > 0) {
+		kprintf("tlbb: %u TLB misses saved, %u.%02u per switch\n",
+			faults[0] - faults[1],
+			(faults[0] - faults[1]) / switches[0],
+			(faults[0] - faults[1]) * 100 / switches[0] % 100);
+	}
+	return 0;
+}
+
+/*
+ * Command for measuring what fault-around saves: runs a userlevel
+ * program once with fault-around off and once with it on, and reports
+ * both fault counts. Without arguments it does this for matmult, sort
+ * and huge in turn.
+ */
+static
+int
+fab_run(int nargs, char **args)
+{
+	unsigned faults[2], mapped, preloaded;
+	int i, result;
+
+	for (i=0; i<2; i++) {
+		vm_faultaround_set(i ? FAULTAROUND_MAX : 0, true);
+		faults[i] = vm_faultcount();
+		result = common_prog(nargs, args);
+		faults[i] = vm_faultcount() - faults[i];
+		if (result) {
+			vm_faultaround_set(FAULTAROUND_MAX, true);
+			return result;
+		}
+	}
+	vm_faultaround_count(&mapped, &preloaded);
+	kprintf("fab: %s: %u faults without fault-around, %u with it, "
+		"%u%% fewer\n", args[0], faults[0], faults[1],
+		faults[0] > faults[1] ?
+		(faults[0] - faults[1]) * 100 / faults[0] : 0);
+	kprintf("fab: %u pages mapped ahead, %u TLB entries preloaded "
+		"so far\n", mapped, preloaded);
+	return 0;
+}
+
+static
+int
+cmd_fabench(int nargs, char **args)
+{
+	const char *defprogs[] = { "/testbin/matmult", "/testbin/sort",
+				   "/testbin/huge", NULL };
+	char prog[32];
+	char *defargs[2] = { prog, NULL };
+	int i, result;
+
+	/* drop the leading "fab" */
+	args++;
+	nargs--;
+	if (nargs > 0) {
+		return fab_run(nargs, args);
+	}
+
+	for (i=0; defprogs[i] != NULL; i++) {
+		/* opening the program may change the path, use a copy */
+		strcpy(prog, defprogs[i]);
+		result = fab_run(1, defargs);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Command for measuring what the zero pool saves: runs a userlevel
+ * program once with the zero pool turned off, so every zero-fill
+ * fault zeroes its own frame, and once with it on, and reports the
+ * run time and the average time spent in vm_fault per fault. With no
+ * program given it does that for huge and then matmult, which both
+ * touch a lot of fresh memory.
+ */
+static
+int
+zerobench_one(int nargs, char **args)
+{
+	struct timespec before, after, duration;
+	unsigned faults;
+	uint64_t faultns;
+	int i, result;
+
+	for (i=0; i<2; i++) {
+		ft_zeropool_enable(i == 1);
+		if (i == 1) {
+			/* give the zeroing thread a chance to fill the pool */
+			clocksleep(1);
+		}
+		faults = vm_faultcount();
+		faultns = vm_faulttime();
+		gettime(&before);
+		result = common_prog(nargs, args);
+		gettime(&after);
+		faults = vm_faultcount() - faults;
+		faultns = vm_faulttime() - faultns;
+		if (result) {
+			ft_zeropool_enable(true);
+			return result;
+		}
+		timespec_sub(&after, &before, &duration);
+		kprintf("zpb: %s, zero pool %s: %llu.%09lu seconds, "
+			"%u faults, %llu ns/fault\n", args[0],
+			i ? "on" : "off",
+			(unsigned long long) duration.tv_sec,
+			(unsigned long) duration.tv_nsec, faults,
+			faults ? (unsigned long long) (faultns / faults) : 0ULL);
+	}
+	return 0;
+}
+
+static
+int
+cmd_zerobench(int nargs, char **args)
+{
+	char huge[] = "/testbin/huge";
+	char matmult[] = "/testbin/matmult";
+	char *hugeargs[2] = { huge, NULL };
+	char *matmultargs[2] = { matmult, NULL };
+	int result;
+
+	/* drop the leading "zpb" */
+	args++;
+	nargs--;
+	if (nargs > 0) {
+		result = zerobench_one(nargs, args);
+	}
+	else {
+		result = zerobench_one(1, hugeargs);
+		if (result == 0) {
+			result = zerobench_one(1, matmultargs);
+		}
+	}
+	if (result == 0) {
+		ft_printstats();
+	}
+	return result;
+}
+
 /*
  * Command for starting the system shell.
  */
@@ -238,6 +474,7 @@ cmd_sync(int nargs, char **args)
 	(void)nargs;
 	(void)args;
 
+	pc_sync(NULL);
 	vfs_sync();
 
 	return 0;
@@ -408,6 +645,80 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	unsigned faults, mapped, preloaded, prefetched, dropped;
+	uint64_t faultns;
+
+	(void)nargs;
+	(void)args;
+
+	faults = vm_faultcount();
+	faultns = vm_faulttime();
+	vm_faultaround_count(&mapped, &preloaded);
+	kprintf("vm faults: %u, %llu ns each on average\n", faults,
+		faults ? (unsigned long long) (faultns / faults) : 0ULL);
+	kprintf("fault-around: %u pages mapped, %u TLB entries preloaded\n",
+		mapped, preloaded);
+	vm_madvise_count(&prefetched, &dropped);
+	kprintf("madvise: %u pages prefetched, %u dropped behind\n",
+		prefetched, dropped);
+	ft_printstats();
+	swap_printstats();
+	pc_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing the resident set of each process.
+ */
+static
+int
+cmd_ps(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printmem();
+
+	return 0;
+}
+
+/*
+ * Command for printing the page table overhead of each process.
+ */
+static
+int
+cmd_pt(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printpt();
+
+	return 0;
+}
+
+#if OPT_SFS
+/*
+ * Command for printing the sfs buffer cache statistics.
+ */
+static
+int
+cmd_fsstat(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -472,6 +783,10 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[vmb] VM fault benchmark            ",
+	"[tlbb] TLB ASID benchmark           ",
+	"[zpb] Zero pool benchmark           ",
+	"[fab] Fault-around benchmark        ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -512,6 +827,12 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vmstat] VM statistics              ",
+	"[ps] Process memory usage           ",
+	"[pt] Process page table overhead    ",
+#if OPT_SFS
+	"[fsstat] SFS buffer cache stats     ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -561,6 +882,12 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vmstat",     cmd_vmstat },
+	{ "ps",		cmd_ps },
+	{ "pt",		cmd_pt },
+#if OPT_SFS
+	{ "fsstat",	cmd_fsstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -571,6 +898,10 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "vmb",	cmd_vmbench },
+	{ "tlbb",	cmd_tlbbench },
+	{ "zpb",	cmd_zerobench },
+	{ "fab",	cmd_fabench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
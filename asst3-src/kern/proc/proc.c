@@ -58,6 +58,13 @@
  */
 struct proc *kproc;
 
+/*
+ * Every process, for proc_printmem. A spinlock because processes are
+ * destroyed in places that can't sleep.
+ */
+static struct proc *allprocs;
+static struct spinlock allprocs_lock = SPINLOCK_INITIALIZER;
+
 /*
  * Create a proc structure.
  */
@@ -95,6 +102,11 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 	proc->p_filetable = NULL;
 
+	spinlock_acquire(&allprocs_lock);
+	proc->p_next = allprocs;
+	allprocs = proc;
+	spinlock_release(&allprocs_lock);
+
 	return proc;
 }
 
@@ -107,6 +119,8 @@ proc_create(const char *name)
 void
 proc_destroy(struct proc *proc)
 {
+	struct proc **pp;
+
 	/*
 	 * You probably want to destroy and null out much of the
 	 * process (particularly the address space) at exit time if
@@ -118,6 +132,14 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+	/* Take it off the list first so nobody looks at its address space. */
+	spinlock_acquire(&allprocs_lock);
+	for (pp = &allprocs; *pp != proc; pp = &(*pp)->p_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = proc->p_next;
+	spinlock_release(&allprocs_lock);
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -484,3 +506,145 @@ proc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+/*
+ * What proc_printmem and proc_printpt print about one process. It is
+ * copied out under the locks and printed after they are released, since
+ * kprintf can take a long time and may sleep.
+ */
+struct procmem {
+	pid_t pm_pid;
+	char pm_name[32];
+	unsigned pm_rss;
+	unsigned pm_rsspeak;
+	unsigned pm_rsscap;
+	unsigned pm_tables;
+	unsigned pm_shared;
+	unsigned pm_live;
+	unsigned pm_l2freed;
+};
+
+/*
+ * Copy out a procmem for each process that has an address space, with
+ * the page table counts too if PT. Returns a kmalloc'd array and sets
+ * *NUM, or returns NULL if out of memory. The array is allocated with
+ * the list unlocked; if the list has grown meanwhile, start over with
+ * a bigger one. The address space can't go away under us: exec swaps
+ * it out under p_lock and proc_destroy takes the process off the list
+ * before destroying it.
+ */
+static
+struct procmem *
+proc_snapmem(bool pt, unsigned *num)
+{
+	struct proc *proc;
+	struct addrspace *as;
+	struct procmem *pm;
+	unsigned max, n;
+
+	max = 1;
+	spinlock_acquire(&allprocs_lock);
+	for (proc = allprocs; proc != NULL; proc = proc->p_next) {
+		max++;
+	}
+	spinlock_release(&allprocs_lock);
+
+	while (1) {
+		pm = kmalloc(max * sizeof(*pm));
+		if (pm == NULL) {
+			return NULL;
+		}
+		n = 0;
+		spinlock_acquire(&allprocs_lock);
+		for (proc = allprocs; proc != NULL && n < max;
+		     proc = proc->p_next) {
+			spinlock_acquire(&proc->p_lock);
+			as = proc->p_addrspace;
+			if (as != NULL) {
+				pm[n].pm_pid = proc->p_pid;
+				snprintf(pm[n].pm_name, sizeof(pm[n].pm_name),
+					 "%s", proc->p_name);
+				pm[n].pm_rss = as->as_rss;
+				pm[n].pm_rsspeak = as->as_rsspeak;
+				pm[n].pm_rsscap = as->as_rsscap;
+				pm[n].pm_l2freed = as->as_l2freed;
+				if (pt) {
+					as_ptstats(as, &pm[n].pm_tables,
+						   &pm[n].pm_shared,
+						   &pm[n].pm_live);
+				}
+				n++;
+			}
+			spinlock_release(&proc->p_lock);
+		}
+		spinlock_release(&allprocs_lock);
+		if (proc == NULL) {
+			*num = n;
+			return pm;
+		}
+		kfree(pm);
+		max *= 2;
+	}
+}
+
+/*
+ * Print pid, resident set, peak and RSS limit (in pages) of each
+ * process that has an address space.
+ */
+void
+proc_printmem(void)
+{
+	struct procmem *pm;
+	unsigned i, n;
+
+	pm = proc_snapmem(false, &n);
+	if (pm == NULL) {
+		kprintf("proc_printmem: out of memory\n");
+		return;
+	}
+	kprintf("  pid      rss     peak    limit  name\n");
+	for (i = 0; i < n; i++) {
+		if (pm[i].pm_rsscap == RSSCAP_NONE) {
+			kprintf("%5d %8u %8u        -  %s\n",
+				pm[i].pm_pid, pm[i].pm_rss,
+				pm[i].pm_rsspeak, pm[i].pm_name);
+		}
+		else {
+			kprintf("%5d %8u %8u %8u  %s\n",
+				pm[i].pm_pid, pm[i].pm_rss,
+				pm[i].pm_rsspeak, pm[i].pm_rsscap,
+				pm[i].pm_name);
+		}
+	}
+	kfree(pm);
+}
+
+/*
+ * Print, for each process that has an address space, its second-level
+ * page tables (and how many are shared since fork), the entries in use
+ * in them, what the tables take including the first-level one, and
+ * how many were freed for being empty.
+ */
+void
+proc_printpt(void)
+{
+	struct procmem *pm;
+	unsigned i, n;
+
+	pm = proc_snapmem(true, &n);
+	if (pm == NULL) {
+		kprintf("proc_printpt: out of memory\n");
+		return;
+	}
+	kprintf("  pid  tables  shared     ptes  fill%%    kbytes  freed  name\n");
+	for (i = 0; i < n; i++) {
+		kprintf("%5d %7u %7u %8u %5u %9u %6u  %s\n",
+			pm[i].pm_pid, pm[i].pm_tables, pm[i].pm_shared,
+			pm[i].pm_live,
+			pm[i].pm_tables ?
+			pm[i].pm_live * 100 / (pm[i].pm_tables * 1024) : 0,
+			(pm[i].pm_tables + 1) * PAGE_SIZE / 1024,
+			pm[i].pm_l2freed, pm[i].pm_name);
+	}
+	kfree(pm);
+}
@@ -47,6 +47,8 @@
 #include <vnode.h>
 #include <openfile.h>
 #include <filetable.h>
+#include <addrspace.h>
+#include <pagecache.h>
 #include <syscall.h>
 
 /*
@@ -91,6 +93,11 @@ sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 	}
 	kfree(kpath);
 
+	if (flags & O_TRUNC) {
+		/* the page cache mustn't write the old contents back */
+		pc_truncate(file->of_vnode);
+	}
+
 	/*
 	 * Place the file in our process's file table, which gives us
 	 * the result file descriptor.
@@ -144,11 +151,35 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 
 	/* set up a uio with the buffer, its size, and the current offset */
 	uio_uinit(&iov, &useruio, buf, size, pos, rw);
+	if (locked && rw == UIO_READ) {
+		/* let the file system see if we're reading sequentially */
+		useruio.uio_ra = &file->of_ra;
+	}
+
+	if (rw == UIO_WRITE) {
+		/*
+		 * Write back any dirty cached page of the range first;
+		 * written back later it would overwrite this write.
+		 */
+		result = pc_flush(file->of_vnode, pos, size);
+		if (result) {
+			goto fail;
+		}
+	}
 
 	/* do the read or write */
 	result = (rw == UIO_READ) ?
 		VOP_READ(file->of_vnode, &useruio) :
 		VOP_WRITE(file->of_vnode, &useruio);
+	if (rw == UIO_WRITE) {
+		/*
+		 * The next exec or mmap of the file has to see this, even
+		 * if the write failed part way.
+		 */
+		pc_invalidate(file->of_vnode,
+			      useruio.uio_offset - (size - useruio.uio_resid),
+			      size - useruio.uio_resid);
+	}
 	if (result) {
 		goto fail;
 	}
@@ -288,6 +319,35 @@ sys_lseek(int fd, off_t offset, int whence, off_t *retval)
 	return 0;
 }
 
+/*
+ * fsync() - write out what the page cache has of the file (from our
+ * mappings or anyone else's), then have the file system flush it.
+ */
+int
+sys_fsync(int fd)
+{
+	struct openfile *file;
+	struct addrspace *as;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	as = proc_getas();
+	if (as != NULL) {
+		as_sync_file(as, file->of_vnode);
+	}
+	result = pc_sync(file->of_vnode);
+	if (result == 0) {
+		result = VOP_FSYNC(file->of_vnode);
+	}
+
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
 /*
  * dup2() - clone a file descriptor.
  */
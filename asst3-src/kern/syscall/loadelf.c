@@ -102,6 +102,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
 	u.uio_rw = UIO_READ;
 	u.uio_space = as;
+	u.uio_ra = NULL;
 
 	result = VOP_READ(v, &u);
 	if (result) {
@@ -259,7 +260,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Now actually load each segment.
+	 * Now actually load each segment. Normally that just means
+	 * telling the VM system where in the file the segment is; its
+	 * pages are read in when they are first touched. A segment that
+	 * shares a page with one that is already set up that way is
+	 * read in now.
 	 */
 
 	for (i=0; i<eh.e_phnum; i++) {
@@ -288,9 +293,18 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
-		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+
+		result = as_define_file(as, ph.p_vaddr, v, ph.p_offset,
+					ph.p_filesz);
+		if (result == EEXIST) {
+			result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
+					      ph.p_memsz, ph.p_filesz,
+					      ph.p_flags & PF_X);
+		}
 		if (result) {
 			return result;
 		}
@@ -69,6 +69,7 @@ openfile_create(struct vnode *vn, int accmode)
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
 	file->of_offset = 0;
+	bzero(&file->of_ra, sizeof(file->of_ra));
 	file->of_refcount = 1;
 
 	return file;
@@ -354,6 +354,11 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 		kfree(newname);
 		return ENOMEM;
 	}
+	/* resource limits survive exec */
+	oldvm = proc_getas();
+	if (oldvm != NULL) {
+		as_copy_limits(oldvm, newvm);
+	}
 
 	/* replace address spaces, and activate the new one */
 	oldvm = proc_setas(newvm);
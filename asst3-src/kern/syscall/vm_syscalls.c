@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Memory-related syscalls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/* mmap protection bits, the same as in userland <unistd.h> */
+#define PROT_READ	1
+#define PROT_WRITE	2
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return where it
+ * was. Growing just makes the addresses valid, the pages are zeroed
+ * when they are first touched; shrinking frees them right away.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = proc_getas();
+	KASSERT(as != NULL);
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+	*retval = (int32_t)oldbreak;
+	return 0;
+}
+
+/*
+ * mmap: map LENGTH bytes of open file FD, from OFFSET on, and return
+ * the address. This is the UNSW mmap: there are no flags and the
+ * kernel picks the address. Mappings are always shared: every process
+ * mapping the file sees the same pages, and what is written to them
+ * goes back to the file on munmap, fsync, or when the page cache lets
+ * go of them. Pages past the end of the file read as zeros and are
+ * never written back.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int32_t *retval)
+{
+	struct openfile *file;
+	vaddr_t addr;
+	int result;
+
+	if (length == 0 || (prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+	if (offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+	if (((prot & PROT_READ) && file->of_accmode == O_WRONLY) ||
+	    ((prot & PROT_WRITE) && file->of_accmode == O_RDONLY)) {
+		result = EACCES;
+		goto out;
+	}
+
+	/* can this kind of file be mapped at all? */
+	result = VOP_MMAP(file->of_vnode);
+	if (result) {
+		goto out;
+	}
+
+	result = as_mmap(proc_getas(), length, (prot & PROT_WRITE) != 0,
+			 file->of_vnode, offset, &addr);
+	if (result) {
+		goto out;
+	}
+	*retval = (int32_t)addr;
+
+ out:
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * munmap: remove the mapping that starts at ADDR.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	return as_munmap(proc_getas(), (vaddr_t)addr);
+}
+
+/*
+ * madvise: a hint about how [ADDR, ADDR+LEN) will be used.
+ */
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	return as_madvise(proc_getas(), (vaddr_t)addr, len, advice);
+}
+
+/*
+ * getrusage: only RUSAGE_SELF, and only the memory fields are filled
+ * in. A fault is major if it had to read the page from swap or from a
+ * file.
+ */
+int
+sys_getrusage(int who, userptr_t ru)
+{
+	struct addrspace *as;
+	struct rusage usage;
+
+	if (who != RUSAGE_SELF) {
+		return EINVAL;
+	}
+	as = proc_getas();
+	bzero(&usage, sizeof(usage));
+	if (as != NULL) {
+		usage.ru_maxrss = as->as_rsspeak * (PAGE_SIZE / 1024);
+		usage.ru_majflt = as->as_majflt;
+		usage.ru_minflt = as->as_faults - as->as_majflt;
+	}
+	return copyout(&usage, ru, sizeof(usage));
+}
+
+/*
+ * getrlimit/setrlimit: only RLIMIT_RSS and RLIMIT_STACK are supported.
+ */
+int
+sys_getrlimit(int resource, userptr_t rl)
+{
+	struct addrspace *as;
+	struct rlimit lim;
+
+	if (resource != RLIMIT_RSS && resource != RLIMIT_STACK) {
+		return EINVAL;
+	}
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	if (resource == RLIMIT_RSS) {
+		lim.rlim_cur = as->as_rsscur;
+		lim.rlim_max = as->as_rssmax;
+	}
+	else {
+		lim.rlim_cur = as->as_stackcur;
+		lim.rlim_max = as->as_stackmax;
+	}
+	return copyout(&lim, rl, sizeof(lim));
+}
+
+int
+sys_setrlimit(int resource, const_userptr_t rl)
+{
+	struct addrspace *as;
+	struct rlimit lim;
+	int result;
+
+	if (resource != RLIMIT_RSS && resource != RLIMIT_STACK) {
+		return EINVAL;
+	}
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	result = copyin(rl, &lim, sizeof(lim));
+	if (result) {
+		return result;
+	}
+	if (resource == RLIMIT_STACK) {
+		return as_setrlimit_stack(as, &lim);
+	}
+	return as_setrlimit_rss(as, &lim);
+}
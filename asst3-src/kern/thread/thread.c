@@ -182,6 +182,21 @@ cpu_create(unsigned hardware_number)
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
 
+	c->c_numframes = 0;
+	c->c_frame_hits = 0;
+	c->c_frame_refills = 0;
+	c->c_frame_drains = 0;
+	c->c_vm_faults = 0;
+	c->c_vm_faultns = 0;
+	c->c_fa_mapped = 0;
+	c->c_fa_preloaded = 0;
+	c->c_madv_prefetched = 0;
+	c->c_madv_dropped = 0;
+	c->c_asid_gen = 0;
+	c->c_asid_next = 0;
+	c->c_asid_cur = 0;
+	c->c_as_activates = 0;
+
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
@@ -252,6 +267,25 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus in the system.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Get a cpu by its software number.
+ */
+struct cpu *
+cpu_get(unsigned num)
+{
+	KASSERT(num < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
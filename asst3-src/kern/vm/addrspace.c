@@ -29,15 +29,20 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
 #include <elf.h>
+#include <vnode.h>
+#include <pagecache.h>
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -62,12 +67,47 @@ as_create(void)
 	/*
 	 * Initialize as needed.
 	 */
-	as->head_region = NULL;
+	as->regions = NULL;
+	as->nregions = 0;
+	as->maxregions = 0;
+	as->lastregion = 0;
+	as->heap_start = 0;
+	as->heap_end = 0;
+	as->stack_limit = USERSTACKMAX;
+	as->as_stackcur = USERSTACKMAX;
+	as->as_stackmax = RLIM_INFINITY;
+	as->fa_last = 0;
+	as->fa_window = 0;
+	as->as_rss = 0;
+	as->as_rsspeak = 0;
+	as->as_rsscur = RLIM_INFINITY;
+	as->as_rssmax = RLIM_INFINITY;
+	as->as_rsscap = RSSCAP_NONE;
+	as->as_rsshand = 0;
+	as->as_faults = 0;
+	as->as_majflt = 0;
+	as->as_l2freed = 0;
 	//as->vstackbase = 0;
 	as->isPrepared = 0;
 	//we use one page for page table, each entry is 4bytes 
 	//so we should have 1024 elements in page table including 1levle and 2level
 	as->pagetable = (PTE **)alloc_kpages(1);
+	if (as->pagetable == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	//one ASID per cpu, none yet
+	as->as_asids = kmalloc(cpu_count() * sizeof(uint32_t));
+	if (as->as_asids == NULL) {
+		free_kpages((vaddr_t)as->pagetable);
+		kfree(as);
+		return NULL;
+	}
+	bzero(as->as_asids, cpu_count() * sizeof(uint32_t));
+	as->as_lastcpu = 0;
+	spinlock_init(&as->as_ptlock);
+	bzero(as->as_l2shared, sizeof(as->as_l2shared));
+	as->as_pageouts = 0;
 	//page table is a lazy strucutre, so we assign null pointers when we initialize
 	for(int i=0;i<1024;i++){
 		as->pagetable[i] = NULL;
@@ -87,59 +127,34 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	/*
-	 * Write this.
-	 */
-	kprintf("using wrong shit copy\n");
 	newas->isPrepared = old->isPrepared;
-	//newas->vstackbase = old->vstackbase;
-	//copy page table
-	for(int i=0;i<1024;i++){
-		//newas->pagetable[i] = old->pagetable[i];
-		// if(old->pagetable[i]!= NULL){
-		// 	vaddr_t copy = alloc_kpages(1);
-		// 	if(copy == 0){
-		// 		as_destroy(newas);
-		// 		return ENOMEM;
-		// 	}
-		// 	memmove((void *)copy,(const void *)old->pagetable[i],PAGE_SIZE);
-		// 	newas->pagetable[i] = (PTE *)copy;
-		// }
-		newas->pagetable[i] = NULL;
-	}
-
-
-	//copy region list
-	//old as headRegion is null then we don't need to do anything
-	// if(old->head_region == NULL){
-	// 	return 0;
-	// }
-	struct region_element * current_old;
-	current_old = old->head_region;
-	struct region_element * current_new;
-	current_new = newas->head_region;
-	while(current_old != NULL){
-		struct region_element * temp = kmalloc(sizeof(struct region_element));
-		if(temp == NULL){
+	newas->heap_start = old->heap_start;
+	newas->heap_end = old->heap_end;
+	as_copy_limits(old, newas);
+	//share page table
+	//neither the tables nor the pages are copied, both address spaces
+	//use them read-only and whoever writes first gets a private copy
+	ft_share_pagetable(old, newas);
+	//old is ours and its TLB entries may still allow writes to the
+	//pages that are now shared
+	vm_tlb_flush_as(old);
+
+	//copy regions
+	if(old->nregions > 0){
+		newas->regions = kmalloc(old->maxregions * sizeof(region));
+		if(newas->regions == NULL){
 			as_destroy(newas);
-			//panic("null region 1\n");
 			return ENOMEM;
 		}
-		temp->vbase = current_old->vbase;
-		temp->npages = current_old->npages;
-		temp->permission = current_old->permission;
-		temp->next = NULL;
-		if(newas->head_region == NULL){
-			newas->head_region = temp;
-		}else{
-			current_new = newas->head_region;
-			while(current_new->next != NULL){
-				current_new = current_new->next;
+		memcpy(newas->regions, old->regions,
+		       old->nregions * sizeof(region));
+		newas->nregions = old->nregions;
+		newas->maxregions = old->maxregions;
+		for(unsigned i=0;i<newas->nregions;i++){
+			if(newas->regions[i].vnode != NULL){
+				VOP_INCREF(newas->regions[i].vnode);
 			}
-			current_new->next = temp;
 		}
-		current_old = current_old->next;
-
 	}
 	*ret = newas;
 	return 0;
@@ -152,9 +167,19 @@ as_destroy(struct addrspace *as)
 	 * Clean up as needed.
 	 */
 	//free pagetable
-	//free 2-level first
+	//free 2-level first, along with the frames and swap slots
+	//the entries refer to
 	for(int i=0;i<1024;i++){
 		if(as->pagetable[i] != NULL){
+			//still shared with someone else, leave it to them
+			if(PT_L2_ISSHARED(as, i) && ft_release_table(as, i)){
+				continue;
+			}
+			for(int j=0;j<1024;j++){
+				if(as->pagetable[i][j] != 0){
+					ft_release_pte(as, &as->pagetable[i][j]);
+				}
+			}
 			free_kpages((vaddr_t)as->pagetable[i]);
 		}
 	}
@@ -162,19 +187,22 @@ as_destroy(struct addrspace *as)
 	//free 1-level
 	free_kpages((vaddr_t)as->pagetable);
 	//free regions
-	struct region_element * current;
-	while(as->head_region != NULL){
-		current = as->head_region;
-		as->head_region = as->head_region->next;
-		kfree(current);
+	for(unsigned i=0;i<as->nregions;i++){
+		if(as->regions[i].vnode != NULL){
+			VOP_DECREF(as->regions[i].vnode);
+		}
 	}
-	free_kpages((vaddr_t)as);
+	kfree(as->regions);
+	spinlock_cleanup(&as->as_ptlock);
+	//its TLB entries can stay, nobody gets its ASIDs before the
+	//next rollover
+	kfree(as->as_asids);
+	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -187,16 +215,10 @@ as_activate(void)
 	}
 
 	/*
-	 * Write this.
+	 * The TLB keeps the entries of other address spaces, they are
+	 * told apart by ASID.
 	 */
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	vm_tlb_activate(as);
 }
 
 void
@@ -209,6 +231,651 @@ as_deactivate(void)
 	 */
 }
 
+/*
+ * Region index. as->regions is an array sorted by vbase; regions
+ * never overlap, so the region an address is in is the last one
+ * starting at or below it, found by binary search.
+ */
+
+static
+vaddr_t
+region_top(const region *r)
+{
+	return r->vbase + r->npages * PAGE_SIZE;
+}
+
+// number of regions starting at or below vaddr
+static
+unsigned
+region_search(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = as->nregions;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(as->regions[mid].vbase <= vaddr){
+			lo = mid + 1;
+		}else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	region *r;
+	unsigned i;
+
+	if(as->lastregion < as->nregions){
+		r = &as->regions[as->lastregion];
+		if(vaddr >= r->vbase && vaddr < region_top(r)){
+			return r;
+		}
+	}
+
+	i = region_search(as, vaddr);
+	if(i == 0){
+		return NULL;
+	}
+	r = &as->regions[i - 1];
+	if(vaddr >= region_top(r)){
+		return NULL;
+	}
+	as->lastregion = i - 1;
+	return r;
+}
+
+/*
+ * The stack is the region that ends at USERSTACK. A fault below it
+ * grows it down to the faulting page, as long as that is within the
+ * stack limit and doesn't reach the region below. as_mmap and as_sbrk
+ * keep out of the way, so normally only a bad pointer can get in the
+ * way.
+ */
+region *
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+	region *r;
+
+	if(as->nregions == 0){
+		return NULL;
+	}
+	r = &as->regions[as->nregions - 1];
+	vaddr &= PAGE_FRAME;
+	if(region_top(r) != USERSTACK || vaddr >= r->vbase ||
+	   vaddr < USERSTACK - as->stack_limit){
+		return NULL;
+	}
+	if(as->nregions > 1 &&
+	   region_top(&as->regions[as->nregions - 2]) > vaddr){
+		return NULL;
+	}
+	r->npages += (r->vbase - vaddr) / PAGE_SIZE;
+	r->vbase = vaddr;
+	as->lastregion = as->nregions - 1;
+	return r;
+}
+
+// make sure there is room for N more regions
+static
+int
+region_reserve(struct addrspace *as, unsigned n)
+{
+	region *r;
+	unsigned max;
+
+	if(as->nregions + n <= as->maxregions){
+		return 0;
+	}
+	//double the array, or more if that isn't enough
+	max = as->maxregions ? as->maxregions * 2 : 8;
+	if(max < as->nregions + n){
+		max = as->nregions + n;
+	}
+	r = kmalloc(max * sizeof(region));
+	if(r == NULL){
+		return ENOMEM;
+	}
+	if(as->nregions > 0){
+		memcpy(r, as->regions, as->nregions * sizeof(region));
+	}
+	kfree(as->regions);
+	as->regions = r;
+	as->maxregions = max;
+	return 0;
+}
+
+// put a new anonymous region [VBASE, TOP) with permissions FLAG at
+// index I. there must be room
+static
+void
+region_open(struct addrspace *as, unsigned i, vaddr_t vbase, vaddr_t top,
+	    int flag)
+{
+	region *r;
+
+	KASSERT(as->nregions < as->maxregions);
+	memmove(&as->regions[i + 1], &as->regions[i],
+		(as->nregions - i) * sizeof(region));
+	as->nregions++;
+	r = &as->regions[i];
+	r->vbase = vbase;
+	r->npages = (top - vbase) / PAGE_SIZE;
+	r->permission = flag;
+	r->vnode = NULL;
+	r->fileoffset = 0;
+	r->filevaddr = 0;
+	r->filesize = 0;
+	r->shared = false;
+	r->advice = MADV_NORMAL;
+}
+
+// cut anonymous region I in two at VADDR, a page boundary inside it.
+// there must be room
+static
+void
+region_split(struct addrspace *as, unsigned i, vaddr_t vaddr)
+{
+	region *r;
+
+	KASSERT(as->nregions < as->maxregions);
+	KASSERT(as->regions[i].vnode == NULL);
+	memmove(&as->regions[i + 1], &as->regions[i],
+		(as->nregions - i) * sizeof(region));
+	as->nregions++;
+	r = &as->regions[i];
+	KASSERT(vaddr > r->vbase && vaddr < region_top(r));
+	r[1].vbase = vaddr;
+	r[1].npages = r->npages - (vaddr - r->vbase) / PAGE_SIZE;
+	r->npages -= r[1].npages;
+}
+
+/*
+ * Add the region [VBASE, TOP) with permissions FLAG. It may overlap
+ * regions already there (segments can share a page). The pages they
+ * share become regions of their own with the permissions of both, and
+ * the rest of each keeps its own, so the text a data segment shares a
+ * page with is writable in that page only.
+ */
+static
+int
+region_insert(struct addrspace *as, vaddr_t vbase, vaddr_t top, int flag)
+{
+	unsigned first, last, i;
+	vaddr_t va;
+	int result;
+
+	//regions [first, last) overlap the new one
+	first = region_search(as, vbase);
+	if(first > 0 && region_top(&as->regions[first - 1]) > vbase){
+		first--;
+	}
+	last = region_search(as, top - 1);
+	for(i=first; i<last; i++){
+		if(as->regions[i].vnode != NULL){
+			//can't split a file segment
+			return EEXIST;
+		}
+	}
+	//two splits, and a new region for each gap between them
+	result = region_reserve(as, last - first + 3);
+	if(result){
+		return result;
+	}
+
+	//cut off what sticks out at either end
+	if(first < last && as->regions[first].vbase < vbase){
+		region_split(as, first, vbase);
+		first++;
+		last++;
+	}
+	if(first < last && region_top(&as->regions[last - 1]) > top){
+		region_split(as, last - 1, top);
+	}
+
+	//now [first, last) are inside [vbase, top): they get FLAG too,
+	//and the gaps between them are new
+	va = vbase;
+	for(i=first; i<last; i++){
+		if(as->regions[i].vbase > va){
+			region_open(as, i, va, as->regions[i].vbase, flag);
+			i++;
+			last++;
+		}
+		as->regions[i].permission |= flag;
+		va = region_top(&as->regions[i]);
+	}
+	if(va < top){
+		region_open(as, last, va, top, flag);
+	}
+	as->lastregion = first;
+	return 0;
+}
+
+// remove region I
+static
+void
+region_remove(struct addrspace *as, unsigned i)
+{
+	KASSERT(i < as->nregions);
+	memmove(&as->regions[i], &as->regions[i + 1],
+		(as->nregions - i - 1) * sizeof(region));
+	as->nregions--;
+	as->lastregion = 0;
+}
+
+/*
+ * Throw away the pages in [START, END): free their frames and swap
+ * slots and clear their PTEs, so touching them again gets a fresh
+ * page, and free the second-level tables that are left empty. Only
+ * the process itself changes its mappings, so dropping them from this
+ * cpu's TLB is enough.
+ */
+static
+int
+release_pages(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	unsigned l1;
+	PTE *pte;
+	int result;
+
+	for(va = start; va < end; va += PAGE_SIZE){
+		l1 = PT_L1_INDEX(va);
+		if(as->pagetable[l1] == NULL){
+			continue;
+		}
+		pte = &as->pagetable[l1][PT_L2_INDEX(va)];
+		if(*pte == 0){
+			continue;
+		}
+		if(PT_L2_ISSHARED(as, l1)){
+			result = ft_split_table(as, l1);
+			if(result){
+				return result;
+			}
+			pte = &as->pagetable[l1][PT_L2_INDEX(va)];
+		}
+		ft_release_pte(as, pte);
+		vm_tlb_invalidate(as, va);
+	}
+	if(start < end){
+		for(l1 = PT_L1_INDEX(start); l1 <= PT_L1_INDEX(end - 1); l1++){
+			if(ft_free_table(as, l1)){
+				as->as_l2freed++;
+			}
+		}
+	}
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	vaddr_t oldtop, newtop;
+	region *r;
+	unsigned next;
+	int result;
+
+	*oldbreak = as->heap_end;
+	if(amount < 0 && (vaddr_t)-amount > as->heap_end - as->heap_start){
+		return EINVAL;
+	}
+	if(amount > 0 && (vaddr_t)amount > USERSPACETOP - as->heap_end){
+		return ENOMEM;
+	}
+
+	oldtop = ROUNDUP(as->heap_end, PAGE_SIZE);
+	newtop = ROUNDUP(as->heap_end + amount, PAGE_SIZE);
+	if(newtop > oldtop){
+		//must not run into the next region up, or into the space
+		//the stack may grow into
+		next = region_search(as, as->heap_start);
+		if(next < as->nregions && as->regions[next].vbase < newtop){
+			return ENOMEM;
+		}
+		if(newtop > USERSTACK - as->stack_limit){
+			return ENOMEM;
+		}
+		if(oldtop == as->heap_start){
+			result = region_insert(as, as->heap_start, newtop,
+					       PF_R | PF_W);
+			if(result){
+				return result;
+			}
+		}else{
+			r = as_find_region(as, as->heap_start);
+			KASSERT(r != NULL);
+			r->npages = (newtop - r->vbase) / PAGE_SIZE;
+		}
+	}else if(newtop < oldtop){
+		result = release_pages(as, newtop, oldtop);
+		if(result){
+			return result;
+		}
+		r = as_find_region(as, as->heap_start);
+		KASSERT(r != NULL);
+		if(newtop == as->heap_start){
+			region_remove(as, r - as->regions);
+		}else{
+			r->npages = (newtop - r->vbase) / PAGE_SIZE;
+		}
+	}
+	as->heap_end += amount;
+	return 0;
+}
+
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+	       off_t offset, size_t filesize)
+{
+	region *r;
+	unsigned first, last, i;
+
+	if(filesize == 0){
+		//all BSS, zero-filled anyway
+		return 0;
+	}
+	//the segment may have been split into several regions where it
+	//shares pages with another; each of them reads its pages from
+	//the same place
+	first = region_search(as, vaddr) - 1;
+	last = region_search(as, vaddr + filesize - 1);
+	KASSERT(first < last);
+	for(i=first; i<last; i++){
+		if(as->regions[i].vnode != NULL){
+			return EEXIST;
+		}
+	}
+	KASSERT(vaddr + filesize <= region_top(&as->regions[last - 1]));
+	for(i=first; i<last; i++){
+		r = &as->regions[i];
+		VOP_INCREF(v);
+		r->vnode = v;
+		r->fileoffset = offset;
+		r->filevaddr = vaddr;
+		r->filesize = filesize;
+	}
+	return 0;
+}
+
+/*
+ * Mappings go top-down from under the stack limit, with an unmapped
+ * page between each one and whatever is above it, and never below
+ * the break, so they leave the heap as much room as they can.
+ */
+int
+as_mmap(struct addrspace *as, size_t length, bool writeable,
+	struct vnode *v, off_t offset, vaddr_t *addr)
+{
+	vaddr_t floor, top, base;
+	size_t size;
+	region *r;
+	unsigned i;
+	int result;
+
+	if(length > USERSPACETOP){
+		return ENOMEM;
+	}
+	size = ROUNDUP(length, PAGE_SIZE);
+	floor = ROUNDUP(as->heap_end, PAGE_SIZE);
+	top = USERSTACK - as->stack_limit;
+	for(i = as->nregions; i > 0; i--){
+		r = &as->regions[i - 1];
+		if(r->vbase >= top){
+			//the stack
+			continue;
+		}
+		if(region_top(r) <= floor || top - region_top(r) > size){
+			break;
+		}
+		top = r->vbase;
+	}
+	if(i > 0 && region_top(&as->regions[i - 1]) > floor){
+		floor = region_top(&as->regions[i - 1]);
+	}
+	if(top < floor || top - floor <= size){
+		return ENOMEM;
+	}
+	base = top - PAGE_SIZE - size;
+
+	result = region_insert(as, base, base + size,
+			       PF_R | (writeable ? PF_W : 0));
+	if(result){
+		return result;
+	}
+	r = as_find_region(as, base);
+	KASSERT(r != NULL && r->vbase == base);
+	VOP_INCREF(v);
+	r->vnode = v;
+	r->fileoffset = offset;
+	r->filevaddr = base;
+	r->filesize = length;
+	r->shared = true;
+	*addr = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr)
+{
+	struct vnode *v;
+	off_t offset;
+	vaddr_t top;
+	region *r;
+	int result;
+
+	r = as_find_region(as, addr);
+	if(r == NULL || r->vbase != addr || !r->shared){
+		return EINVAL;
+	}
+	v = r->vnode;
+	offset = r->fileoffset;
+	top = region_top(r);
+	result = release_pages(as, addr, top);
+	if(result){
+		return result;
+	}
+	region_remove(as, r - as->regions);
+
+	//our writes go to the file now, even if others still map it
+	result = pc_flush(v, offset, top - addr);
+	VOP_DECREF(v);
+	return result;
+}
+
+void
+as_ptstats(struct addrspace *as, unsigned *tables, unsigned *shared,
+	   unsigned *live)
+{
+	*tables = *shared = *live = 0;
+	spinlock_acquire(&as->as_ptlock);
+	for(unsigned i=0;i<1024;i++){
+		if(as->pagetable[i] == NULL){
+			continue;
+		}
+		(*tables)++;
+		if(PT_L2_ISSHARED(as, i)){
+			(*shared)++;
+		}
+		*live += ft_table_live(as->pagetable[i]);
+	}
+	spinlock_release(&as->as_ptlock);
+}
+
+int
+as_madvise(struct addrspace *as, vaddr_t addr, size_t len, int advice)
+{
+	vaddr_t end, va, top;
+	region *r;
+	int result;
+
+	if((addr & ~PAGE_FRAME) != 0 || addr >= USERSPACETOP ||
+	   len > USERSPACETOP - addr){
+		return EINVAL;
+	}
+	if(advice < MADV_NORMAL || advice > MADV_DONTNEED){
+		return EINVAL;
+	}
+	end = ROUNDUP(addr + len, PAGE_SIZE);
+	for(va = addr; va < end; va = region_top(r)){
+		r = as_find_region(as, va);
+		if(r == NULL){
+			return ENOMEM;
+		}
+	}
+
+	for(va = addr; va < end; va = top){
+		r = as_find_region(as, va);
+		KASSERT(r != NULL);
+		top = region_top(r) < end ? region_top(r) : end;
+		switch(advice){
+		    case MADV_WILLNEED:
+			result = vm_willneed(as, r, va, top);
+			break;
+		    case MADV_DONTNEED:
+			//anonymous pages come back zeroed, file pages
+			//from the file (or the page cache, with whatever
+			//was written to the mapping)
+			result = release_pages(as, va, top);
+			break;
+		    default:
+			r->advice = advice;
+			result = 0;
+			break;
+		}
+		if(result){
+			return result;
+		}
+	}
+	return 0;
+}
+
+void
+as_sync_file(struct addrspace *as, struct vnode *v)
+{
+	vaddr_t va;
+	region *r;
+	unsigned i, l1;
+
+	for(i = 0; i < as->nregions; i++){
+		r = &as->regions[i];
+		if(!r->shared || r->vnode != v){
+			continue;
+		}
+		for(va = r->vbase; va < region_top(r); va += PAGE_SIZE){
+			l1 = PT_L1_INDEX(va);
+			//a table shared since fork can't be changed, its
+			//dirty pages just stay dirty
+			if(as->pagetable[l1] == NULL || PT_L2_ISSHARED(as, l1)){
+				continue;
+			}
+			ft_clean_pte(as, &as->pagetable[l1][PT_L2_INDEX(va)]);
+			//the next write has to fault and dirty it again
+			vm_tlb_invalidate(as, va);
+		}
+	}
+}
+
+void
+as_rss_inc(struct addrspace *as)
+{
+	KASSERT(spinlock_do_i_hold(&as->as_ptlock));
+	as->as_rss++;
+	if(as->as_rss > as->as_rsspeak){
+		as->as_rsspeak = as->as_rss;
+	}
+}
+
+int
+as_setrlimit_rss(struct addrspace *as, const struct rlimit *rl)
+{
+	rlim_t pages;
+
+	if(rl->rlim_cur > rl->rlim_max){
+		return EINVAL;
+	}
+	//nobody is privileged, the hard limit only comes down
+	if(rl->rlim_max > as->as_rssmax){
+		return EPERM;
+	}
+	as->as_rsscur = rl->rlim_cur;
+	as->as_rssmax = rl->rlim_max;
+	if(rl->rlim_cur == RLIM_INFINITY){
+		as->as_rsscap = RSSCAP_NONE;
+		return 0;
+	}
+	//a process needs a few pages at once to get anywhere at all
+	pages = rl->rlim_cur / PAGE_SIZE;
+	if(pages < RSSCAP_MIN){
+		pages = RSSCAP_MIN;
+	}
+	as->as_rsscap = pages < RSSCAP_NONE ? pages : RSSCAP_NONE;
+	return 0;
+}
+
+int
+as_setrlimit_stack(struct addrspace *as, const struct rlimit *rl)
+{
+	size_t extent, limit;
+	region *r;
+	unsigned i;
+
+	if(rl->rlim_cur > rl->rlim_max){
+		return EINVAL;
+	}
+	if(rl->rlim_max > as->as_stackmax){
+		return EPERM;
+	}
+	//there is no room for an unlimited stack, it has to fit below
+	//USERSTACK
+	if(rl->rlim_cur > USERSTACK){
+		return ENOMEM;
+	}
+	limit = ROUNDUP((size_t)rl->rlim_cur, PAGE_SIZE);
+	//the stack can't shrink to fit, and its first page is always
+	//there
+	extent = PAGE_SIZE;
+	i = as->nregions;
+	if(i > 0 && region_top(&as->regions[i - 1]) == USERSTACK){
+		i--;
+		extent = as->regions[i].npages * PAGE_SIZE;
+	}
+	if(limit < extent){
+		return EINVAL;
+	}
+	//i is the first region above the stack's way down, nothing
+	//else may be in the new one
+	if(i > 0){
+		r = &as->regions[i - 1];
+		if(region_top(r) > USERSTACK - limit){
+			return ENOMEM;
+		}
+	}
+	if(ROUNDUP(as->heap_end, PAGE_SIZE) > USERSTACK - limit){
+		return ENOMEM;
+	}
+	as->as_stackcur = rl->rlim_cur;
+	as->as_stackmax = rl->rlim_max;
+	as->stack_limit = limit;
+	return 0;
+}
+
+void
+as_copy_limits(struct addrspace *from, struct addrspace *to)
+{
+	to->as_rsscur = from->as_rsscur;
+	to->as_rssmax = from->as_rssmax;
+	to->as_rsscap = from->as_rsscap;
+	to->as_stackcur = from->as_stackcur;
+	to->as_stackmax = from->as_stackmax;
+	to->stack_limit = from->stack_limit;
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
@@ -224,22 +891,19 @@ int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
-	int reminder = memsize % PAGE_SIZE;
-	//vaddr = vaddr - reminder;
-	vaddr &= PAGE_FRAME; // some address has offset
-	vaddr = vaddr - reminder;
-	size_t numberOfPages = 0;
-	if(reminder == 0){
-		numberOfPages = memsize / PAGE_SIZE;
-	}else{
-		numberOfPages = memsize / PAGE_SIZE + 1;
-	}
-	// we need to make sure it points to the base of a page
-
+	vaddr_t top;
 	int flag = 0;
+
+	// we need to make sure it starts at the base of a page, and
+	// covers the whole of the last one
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+	memsize = ROUNDUP(memsize, PAGE_SIZE);
+	top = vaddr + memsize;
+	if(top < vaddr || top > USERSPACETOP){
+		return EFAULT;
+	}
+
 	if(readable){
 		flag |= PF_R;
 	}
@@ -249,82 +913,30 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	if(executable){
 		flag |= PF_X;
 	}
-	// go through region list, find first null pointer
-	if(as->head_region == NULL){
-		struct region_element * temp;
-		temp = kmalloc(sizeof(struct region_element));
-		if (temp == NULL) { // if we can't create temp then, return error
-			//panic("null region 3\n");
-			return ENOMEM;
-		}
-		temp->vbase = vaddr;
-		temp->npages = numberOfPages;
-		temp->permission = flag;
-		temp->next = NULL;
-		as->head_region = temp;
-		return 0;
-	}
-	struct region_element * current = as->head_region;
-	while(current->next != NULL){
-		current = current->next;
-	}
-	//set current next
-	struct region_element * temp = kmalloc(sizeof(struct region_element));
-	if (temp == NULL) { 
-		//panic("null region 4\n");
-		return ENOMEM;
-	}
-	temp->vbase = vaddr;
-	temp->npages = numberOfPages;
-	temp->permission = flag;
-	temp->next = NULL;
-	current->next = temp;	
-	return 0; 
+	return region_insert(as, vaddr, top, flag);
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
-	// we are going to prepare the last one in region list and give it write permission
-	region * current;
-	current = as->head_region;
-	while(current->next != NULL){
-		current = current->next;
-	}
-	//prepare current
-	//check whether region is writeable or not, 
-	//if it is writeable already, then do nothing
-	if(current->permission & PF_W){
-		return 0;
-	}else{
-		as->isPrepared = 1;
-		current->permission |= PF_W;
-	}
+	//while the segments are being loaded every region counts as
+	//writeable, see vm_fault
+	as->isPrepared = 1;
 	return 0;
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
-
-	//if region was writeable before prepare_load function call
-	//then we shouldn't do anything
-	if(as->isPrepared == 0){
-		return 0;
-	}
 	as->isPrepared = 0;
-	struct region_element * current;
-	current = as->head_region;
-	while(current->next != NULL){
-		current = current->next;
+	//the heap starts out empty, right above the program
+	if(as->nregions > 0){
+		as->heap_start = region_top(&as->regions[as->nregions - 1]);
+		as->heap_end = as->heap_start;
 	}
-	current->permission &= ~PF_W;
+	//pages loaded while everything was writeable may still be
+	//writeable in the TLB
+	vm_tlb_flush_as(as);
 	return 0;
 }
 
@@ -332,14 +944,16 @@ int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
 
-	/*
-	 * Write this.
-	 */
-	as_define_region(as,USERSTACK - 16*4096, 16*4096,
-		 1, 1, 0);
+	int result;
+
+	//one page to start with, vm_fault grows it as it is used
+	result = as_define_region(as, USERSTACK - PAGE_SIZE, PAGE_SIZE,
+				  1, 1, 0);
+	if(result){
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
-	//stackbase should be stack top - stacksize
 	return 0;
 }
@@ -1,67 +1,575 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <membar.h>
+#include <current.h>
 #include <thread.h>
+#include <wchan.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <swap.h>
+#include <pagecache.h>
 
-/* Place your frametable data-structures here 
+/* Place your frametable data-structures here
  * You probably also want to write a frametable initialisation
  * function and call it from vm_bootstrap
  */
 
-// each entry uses n bytes 
+// a PTE that maps a user or page cache frame, and the virtual address
+// it maps. a frame's first mapping is kept in its frame table entry,
+// the others (copy-on-write since fork, or a file page that several
+// processes map) on a list of these
+struct rmap{
+    PTE *pte;
+    vaddr_t vaddr;
+    struct rmap *next;
+};
+
+// each entry uses n bytes
 struct frame_table_entry{
     bool isFree;
     // if 0, frame is locked, otherwise frame is not looked
     // we only lock frames which allocate by OS
     paddr_t address;
+    // buddy order of the block this frame heads, i.e. the block is
+    // 2^order frames long. only meaningful on the first frame of a
+    // block, free or allocated
+    unsigned order;
+    // free list links (frame indices) while this frame heads a free
+    // block, -1 terminates the list
+    int next_free;
+    int prev_free;
+    // reverse map of a user or page cache frame: the PTEs that map it,
+    // rmap.pte is NULL if there are none. the pager uses it to find
+    // and unmap every mapping of the frame it evicts
+    struct rmap rmap;
+    // for a second-level page table: the address space it belongs to,
+    // or NULL while it is shared since fork (and after, until the last
+    // address space using it splits it and we know who that is)
+    struct addrspace *as;
+    // set while the frame is being filled or paged out, the clock
+    // skips busy frames
+    bool busy;
+    // number of PTEs that map this user or page cache frame, the
+    // length of its reverse map. a PTE in a second-level table shared
+    // since fork counts once, for all the address spaces sharing it.
+    // for a second-level page table it is the number of address
+    // spaces sharing the table, or 0 while only one uses it
+    unsigned refcount;
+    // swap slot that still holds the same data as this clean user
+    // frame, or -1. owns one reference to the slot
+    int swapslot;
+    // page cache page held in this frame, or NULL. the page cache
+    // counts its mappings too
+    struct pcpage *pcpage;
+    // for a second-level page table: how many of its entries aren't
+    // 0. changes under the owner's as_ptlock, and not at all while
+    // the table is shared. at 0 the table can go
+    unsigned live;
 };
 
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 static struct spinlock frame_lock = SPINLOCK_INITIALIZER;
+static struct frame_table_entry * frame_table;
 int total_frame_number = 0;
 char hasInitialized = 0;
 
+// binary buddy allocator: free_area[k] is a list of free blocks of
+// 2^k frames, threaded through next_free/prev_free. Blocks are aligned
+// to their size relative to frame_table[0], so the buddy of the block
+// at index i is at index i ^ (1 << k)
+#define FT_MAX_ORDER 10
+static int free_area[FT_MAX_ORDER+1];
+static int free_frame_count = 0;
+// physical address of frame_table[0], used to turn a paddr into an index
+static paddr_t frame_base = 0;
+
+// pager state: the clock hand sweeps the frame table looking for a
+// user frame whose PTE_REF bit is clear. threads that find a PTE_BUSY
+// entry sleep on transit_wchan (with frame_lock) until the page-out
+// finishes. user pages are only evicted for while fewer than
+// FT_RESERVE_FRAMES frames are free, the rest is kept for the kernel,
+// which can't be paged
+#define FT_RESERVE_FRAMES 16
+static int clock_hand = 0;
+// pageouts of clean pages, which didn't have to write anything, and
+// of dirty ones (frame_lock)
+static unsigned evict_clean = 0;
+static unsigned evict_dirty = 0;
+// pageouts of frames mapped more than once, and of page cache pages
+// (frame_lock)
+static unsigned evict_shared = 0;
+static unsigned evict_cached = 0;
+// pageouts for processes at their resident set limit (frame_lock)
+static unsigned evict_local = 0;
+static struct wchan *transit_wchan;
+
+// pool of frames zeroed ahead of time by zero_thread, which does it
+// while its cpu has nothing else to run. allocations that want a
+// zeroed frame take one from here instead of zeroing it themselves.
+// pool frames count as free, and are handed out unzeroed too before
+// anything is paged out (zero_lock). zero_lock comes after frame_lock
+#define ZEROPOOL_MAX 64
+static paddr_t zero_pool[ZEROPOOL_MAX];
+static unsigned zero_count = 0;
+static bool zero_enabled = true;
+static unsigned zero_hits = 0;
+static unsigned zero_misses = 0;
+static unsigned zero_filled = 0;
+// pool frames given back to the buddy lists for a bigger block
+static unsigned zero_drained = 0;
+static struct spinlock zero_lock = SPINLOCK_INITIALIZER;
+static struct wchan *zero_wchan;
+// zero_thread stops filling the pool while fewer than ZERO_LOWATER
+// frames are free, and sleeps on zero_framewchan (with frame_lock)
+// until buddy_free_locked brings them back up
+#define ZERO_LOWATER (FT_RESERVE_FRAMES + ZEROPOOL_MAX)
+static bool zero_starved = false;
+static struct wchan *zero_framewchan;
+
+/*
+ * Free list helpers. Call with frame_lock held.
+ */
+static
+void
+buddy_push(int index, unsigned order)
+{
+    frame_table[index].isFree = true;
+    frame_table[index].order = order;
+    frame_table[index].prev_free = -1;
+    frame_table[index].next_free = free_area[order];
+    if(free_area[order] >= 0){
+        frame_table[free_area[order]].prev_free = index;
+    }
+    free_area[order] = index;
+}
+
+static
+void
+buddy_remove(int index)
+{
+    struct frame_table_entry *fte = &frame_table[index];
+
+    KASSERT(fte->isFree);
+    if(fte->prev_free >= 0){
+        frame_table[fte->prev_free].next_free = fte->next_free;
+    }else{
+        free_area[fte->order] = fte->next_free;
+    }
+    if(fte->next_free >= 0){
+        frame_table[fte->next_free].prev_free = fte->prev_free;
+    }
+    fte->isFree = false;
+    fte->next_free = -1;
+    fte->prev_free = -1;
+}
+
 void ft_initialization(void){
     // find location for frame table first
     vaddr_t location = 0;
     paddr_t ram_size = ram_getsize();
     paddr_t first = ram_getfirstfree();
     int ft_frames = 0;//frames used by frame table
-    //int os_frames = 0; //frames used by os at the beginning 
+    int usable_frames = 0;
     int size_of_ft_entry = 0;
     size_of_ft_entry = sizeof(struct frame_table_entry);
-    //number of total page frames
-    total_frame_number = (ram_size - first)/PAGE_SIZE;
+    //number of total page frames, from first free frame up to top of ram
+    frame_base = ROUNDUP(first, PAGE_SIZE);
+    total_frame_number = (ram_size - frame_base)/PAGE_SIZE;
 
-    if((total_frame_number*size_of_ft_entry)% PAGE_SIZE == 0){
-      ft_frames = total_frame_number*size_of_ft_entry/PAGE_SIZE;
-    }else{
-      ft_frames = (total_frame_number*size_of_ft_entry/PAGE_SIZE) + 1;
-    }
-    location = ram_size - (total_frame_number*size_of_ft_entry);
+    //frame table lives in the topmost frames of ram
+    ft_frames = DIVROUNDUP(total_frame_number*size_of_ft_entry, PAGE_SIZE);
+    location = ram_size - ft_frames*PAGE_SIZE;
     frame_table = (struct frame_table_entry *)(PADDR_TO_KVADDR(location));
-   	//initialize all frame paddr
-   	for(int i = 0;i<total_frame_number;i++){
-   		if(i == 0){
-   			frame_table[0].isFree = true;
-   			frame_table[0].address = (first & PAGE_FRAME) + PAGE_SIZE;
-        //frame_table[0].locked = 0;
-   		}else {
-        frame_table[i].isFree = true;
-        frame_table[i].address = frame_table[i-1].address + PAGE_SIZE;
-       // frame_table[0].locked = 0;
-      }
-   	}
+    usable_frames = total_frame_number - ft_frames;
+
+    for(int k=0;k<=FT_MAX_ORDER;k++){
+        free_area[k] = -1;
+    }
+    //initialize all frame paddr, everything starts out in use
+    for(int i=0;i<total_frame_number;i++){
+        frame_table[i].isFree = false;
+        frame_table[i].address = frame_base + i*PAGE_SIZE;
+        frame_table[i].order = 0;
+        frame_table[i].next_free = -1;
+        frame_table[i].prev_free = -1;
+        frame_table[i].rmap.pte = NULL;
+        frame_table[i].rmap.vaddr = 0;
+        frame_table[i].rmap.next = NULL;
+        frame_table[i].as = NULL;
+        frame_table[i].busy = false;
+        frame_table[i].refcount = 0;
+        frame_table[i].swapslot = -1;
+        frame_table[i].pcpage = NULL;
+        frame_table[i].live = 0;
+    }
 
-   	for(int i=0;i<ft_frames;i++){
-   		frame_table[total_frame_number-1-i].isFree = false;
-   	}
+    //carve the frames below the frame table into the largest aligned
+    //blocks that fit, frames used by the frame table itself are never
+    //put on a free list
+    int i = 0;
+    while(i < usable_frames){
+        unsigned order = FT_MAX_ORDER;
+        while((i & ((1 << order) - 1)) != 0 ||
+              i + (1 << order) > usable_frames){
+            order--;
+        }
+        buddy_push(i, order);
+        free_frame_count += 1 << order;
+        i += 1 << order;
+    }
     hasInitialized = 1;
+
+    transit_wchan = wchan_create("frame_transit");
+    zero_wchan = wchan_create("zero_pool");
+    zero_framewchan = wchan_create("zero_frames");
+    if(transit_wchan == NULL || zero_wchan == NULL ||
+       zero_framewchan == NULL){
+        panic("ft_initialization: wchan_create failed\n");
+    }
+}
+
+/*
+ * Map a physical address back to its frame table index, or -1 if the
+ * address is not managed by the frame table (e.g. memory that was
+ * handed out by ram_stealmem before the frame table existed).
+ */
+static
+int
+frame_index(paddr_t paddr)
+{
+    if(paddr < frame_base){
+        return -1;
+    }
+    paddr_t index = (paddr - frame_base)/PAGE_SIZE;
+    if(index >= (paddr_t)total_frame_number){
+        return -1;
+    }
+    return (int)index;
+}
+
+// frame table entry of the page holding a second-level page table
+static
+struct frame_table_entry *
+table_entry(PTE *table)
+{
+    int index = frame_index(KVADDR_TO_PADDR((vaddr_t)table));
+
+    KASSERT(index >= 0);
+    return &frame_table[index];
+}
+
+/*
+ * Reverse map.
+ *
+ * Every PTE that maps a user or page cache frame is on the frame's
+ * reverse map, with the virtual address it maps. The address space a
+ * PTE belongs to is the owner of the second-level table it is in,
+ * unless that table is shared since fork. Entries beyond the first
+ * are allocated before taking frame_lock (rmap_alloc) and freed after
+ * dropping it (rmap_free), kmalloc can't be called with it held.
+ */
+
+// address space that PTE is in, or NULL if its table is shared
+static
+struct addrspace *
+pte_owner(PTE *pte)
+{
+    return table_entry((PTE *)((vaddr_t)pte & PAGE_FRAME))->as;
+}
+
+static
+void
+rmap_free(struct rmap *list)
+{
+    struct rmap *m;
+
+    while(list != NULL){
+        m = list;
+        list = list->next;
+        kfree(m);
+    }
+}
+
+// get N rmap entries, on a list through next
+static
+int
+rmap_alloc(unsigned n, struct rmap **list)
+{
+    struct rmap *m;
+
+    *list = NULL;
+    while(n-- > 0){
+        m = kmalloc(sizeof(struct rmap));
+        if(m == NULL){
+            rmap_free(*list);
+            *list = NULL;
+            return ENOMEM;
+        }
+        m->next = *list;
+        *list = m;
+    }
+    return 0;
+}
+
+// PTE now maps FTE's frame. takes an entry off *SPARE if it isn't the
+// first mapping. call with frame_lock held
+static
+void
+rmap_add(struct frame_table_entry *fte, PTE *pte, vaddr_t vaddr,
+         struct rmap **spare)
+{
+    struct rmap *m;
+
+    if(fte->rmap.pte == NULL){
+        KASSERT(fte->refcount == 0);
+        fte->rmap.pte = pte;
+        fte->rmap.vaddr = vaddr;
+    }else{
+        m = *spare;
+        KASSERT(m != NULL);
+        *spare = m->next;
+        m->pte = pte;
+        m->vaddr = vaddr;
+        m->next = fte->rmap.next;
+        fte->rmap.next = m;
+    }
+    fte->refcount++;
+}
+
+// PTE doesn't map FTE's frame any more. the entry that is no longer
+// needed goes on *FREED. call with frame_lock held
+static
+void
+rmap_remove(struct frame_table_entry *fte, PTE *pte, struct rmap **freed)
+{
+    struct rmap *m, **mp;
+
+    KASSERT(fte->refcount > 0);
+    fte->refcount--;
+    m = fte->rmap.next;
+    if(fte->rmap.pte == pte){
+        if(m == NULL){
+            fte->rmap.pte = NULL;
+            return;
+        }
+        //move the second one up
+        fte->rmap.pte = m->pte;
+        fte->rmap.vaddr = m->vaddr;
+        fte->rmap.next = m->next;
+    }else{
+        for(mp = &fte->rmap.next; *mp != NULL; mp = &(*mp)->next){
+            if((*mp)->pte == pte){
+                break;
+            }
+        }
+        m = *mp;
+        KASSERT(m != NULL);
+        *mp = m->next;
+    }
+    m->next = *freed;
+    *freed = m;
+}
+
+// drop every mapping of FTE, putting the entries on *FREED. call with
+// frame_lock held
+static
+void
+rmap_clear(struct frame_table_entry *fte, struct rmap **freed)
+{
+    struct rmap *m;
+
+    while(fte->rmap.next != NULL){
+        m = fte->rmap.next;
+        fte->rmap.next = m->next;
+        m->next = *freed;
+        *freed = m;
+    }
+    fte->rmap.pte = NULL;
+    fte->refcount = 0;
+}
+
+void ft_own_table(struct addrspace *as, PTE *table)
+{
+  spinlock_acquire(&frame_lock);
+  table_entry(table)->as = as;
+  table_entry(table)->live = 0;
+  spinlock_release(&frame_lock);
+}
+
+void ft_pte_count(PTE *pte, int delta)
+{
+  struct frame_table_entry *tfte;
+
+  tfte = table_entry((PTE *)((vaddr_t)pte & PAGE_FRAME));
+  KASSERT(delta > 0 || tfte->live >= (unsigned)-delta);
+  tfte->live += delta;
+}
+
+unsigned ft_table_live(PTE *table)
+{
+  return table_entry(table)->live;
+}
+
+bool ft_free_table(struct addrspace *as, unsigned l1)
+{
+  PTE *table;
+
+  spinlock_acquire(&as->as_ptlock);
+  table = as->pagetable[l1];
+  if(table == NULL || PT_L2_ISSHARED(as, l1) ||
+     table_entry(table)->live > 0){
+    spinlock_release(&as->as_ptlock);
+    return false;
+  }
+  //nothing in it is on a reverse map, so only we know about it
+  as->pagetable[l1] = NULL;
+  spinlock_release(&as->as_ptlock);
+  free_kpages((vaddr_t)table);
+  return true;
+}
+
+/*
+ * Allocate a physically contiguous block of 2^order frames. Takes the
+ * smallest free block that is big enough and splits it, putting the
+ * unused upper halves back on the free lists. Returns the index of
+ * the first frame, or -1 if there is none. Call with frame_lock held.
+ */
+static
+int
+buddy_alloc_locked(unsigned order)
+{
+    unsigned k;
+    int index;
+
+    KASSERT(order <= FT_MAX_ORDER);
+    KASSERT(spinlock_do_i_hold(&frame_lock));
+
+    for(k=order;k<=FT_MAX_ORDER;k++){
+        if(free_area[k] >= 0){
+            break;
+        }
+    }
+    if(k > FT_MAX_ORDER){
+        return -1;
+    }
+    index = free_area[k];
+    buddy_remove(index);
+    while(k > order){
+        k--;
+        buddy_push(index + (1 << k), k);
+    }
+    frame_table[index].order = order;
+    free_frame_count -= 1 << order;
+    return index;
+}
+
+static
+paddr_t
+buddy_alloc(unsigned order)
+{
+    int index;
+
+    spinlock_acquire(&frame_lock);
+    index = buddy_alloc_locked(order);
+    spinlock_release(&frame_lock);
+
+    return index < 0 ? 0 : frame_table[index].address;
+}
+
+/*
+ * Return the block headed by frame INDEX to the free lists, merging
+ * it with its buddy for as long as the buddy is free as a whole.
+ * Call with frame_lock held.
+ */
+static
+void
+buddy_free_locked(int index)
+{
+    unsigned order;
+    int buddy;
+
+    KASSERT(spinlock_do_i_hold(&frame_lock));
+    KASSERT(!frame_table[index].isFree);
+    order = frame_table[index].order;
+    free_frame_count += 1 << order;
+    while(order < FT_MAX_ORDER){
+        buddy = index ^ (1 << order);
+        if(buddy >= total_frame_number ||
+           !frame_table[buddy].isFree ||
+           frame_table[buddy].order != order){
+            break;
+        }
+        buddy_remove(buddy);
+        if(buddy < index){
+            index = buddy;
+        }
+        order++;
+    }
+    buddy_push(index, order);
+    if(zero_starved && free_frame_count >= ZERO_LOWATER){
+        zero_starved = false;
+        wchan_wakeall(zero_framewchan, &frame_lock);
+    }
+}
+
+static
+void
+buddy_free(int index)
+{
+    spinlock_acquire(&frame_lock);
+    buddy_free_locked(index);
+    spinlock_release(&frame_lock);
 }
 
-/* Note that this function returns a VIRTUAL address, not a physical 
+/*
+ * Per-cpu frame cache.
+ *
+ * Each cpu keeps a magazine of free single frames in struct cpu
+ * (c_frames), so the common single-frame allocation and free take no
+ * shared lock, only splhigh to keep us on this cpu. The magazine is
+ * refilled from, and drained back to, the buddy lists
+ * FRAMECACHE_BATCH frames at a time under one frame_lock acquisition.
+ * Frames sitting in a magazine look allocated to the buddy allocator.
+ */
+#define FRAMECACHE_BATCH (FRAMECACHE_MAX/2)
+
+/* Call with interrupts off. */
+static
+void
+framecache_refill(struct cpu *c)
+{
+    int index;
+
+    spinlock_acquire(&frame_lock);
+    while(c->c_numframes < FRAMECACHE_BATCH){
+        index = buddy_alloc_locked(0);
+        if(index < 0){
+            break;
+        }
+        c->c_frames[c->c_numframes++] = frame_table[index].address;
+    }
+    spinlock_release(&frame_lock);
+    c->c_frame_refills++;
+}
+
+/* Call with interrupts off. */
+static
+void
+framecache_drain(struct cpu *c, unsigned count)
+{
+    spinlock_acquire(&frame_lock);
+    while(count > 0 && c->c_numframes > 0){
+        buddy_free_locked(frame_index(c->c_frames[--c->c_numframes]));
+        count--;
+    }
+    spinlock_release(&frame_lock);
+    c->c_frame_drains++;
+}
+
+/* Note that this function returns a VIRTUAL address, not a physical
  * address
  * WARNING: this function gets called very early, before
  * vm_bootstrap().  You may wish to modify main.c to call your
@@ -69,50 +577,226 @@ void ft_initialization(void){
  * frame table has been initialised and call ram_stealmem() otherwise.
  */
 
-//get index of first free frame in frame table
-//currently haven't implemented replacement policy like FIFO
+//take a single free frame and return its physical address,
+//from this cpu's frame cache if it has one
+//returns 0 if there is no free frame
 paddr_t get_frame_address(void){
+  struct cpu *c;
   paddr_t result = 0;
-  int has_found = 0;//if we havn't found index, set to 0,otherwise to 1
-  //if there is a free page in frame table
-  //spinlock_acquire(&frame_lock);
-  for(int i=0;i<total_frame_number;i++){
-    spinlock_acquire(&frame_lock);
-    if(frame_table[i].isFree==true){
-      result = frame_table[i].address;
-      frame_table[i].isFree = false;
-      has_found = 1;
-      spinlock_release(&frame_lock);
-      break;
-    }
-    spinlock_release(&frame_lock);
+  int spl;
+
+  spl = splhigh();
+  c = curcpu->c_self;
+  if(c->c_numframes > 0){
+    c->c_frame_hits++;
+  }else{
+    framecache_refill(c);
   }
-  //spinlock_release(&frame_lock);
-  if(has_found == 0 && result == 0){//we haven't found, implement replacement policy
-    //TODO
-   // panic("frame table full\n");
-    return ENOMEM;
+  if(c->c_numframes > 0){
+    result = c->c_frames[--c->c_numframes];
   }
+  splx(spl);
+
   return result;
 }
 
+//give a single frame back to this cpu's frame cache
+static
+void
+put_frame(paddr_t paddr)
+{
+  struct cpu *c;
+  int spl;
 
+  spl = splhigh();
+  c = curcpu->c_self;
+  if(c->c_numframes == FRAMECACHE_MAX){
+    framecache_drain(c, FRAMECACHE_BATCH);
+  }
+  c->c_frames[c->c_numframes++] = paddr;
+  splx(spl);
+}
 
-vaddr_t alloc_kpages(unsigned int npages)
+/*
+ * Zero pool.
+ */
+
+// take a frame from the zero pool, or return 0 if it is empty. WANTZERO
+// says the caller needs it zeroed, and counts towards the hit rate
+static
+paddr_t
+zeropool_take(bool wantzero)
 {
-  /*
-   * IMPLEMENT ME.  You should replace this code with a proper implementation.
-   */
+  paddr_t paddr = 0;
 
+  spinlock_acquire(&zero_lock);
+  if(zero_count > 0){
+    paddr = zero_pool[--zero_count];
+  }
+  if(wantzero && zero_enabled){
+    if(paddr != 0){
+      zero_hits++;
+    }else{
+      zero_misses++;
+    }
+  }
+  if(zero_count < ZEROPOOL_MAX / 2){
+    wchan_wakeone(zero_wchan, &zero_lock);
+  }
+  spinlock_release(&zero_lock);
+  return paddr;
+}
+
+// give every frame in the zero pool back to the buddy lists, so they
+// can merge into a bigger block. called when a multi-page allocation
+// finds none
+static
+void
+zeropool_drain(void)
+{
+  paddr_t paddr;
+  unsigned count = 0;
+
+  while((paddr = zeropool_take(false)) != 0){
+    buddy_free(frame_index(paddr));
+    count++;
+  }
+  spinlock_acquire(&zero_lock);
+  zero_drained += count;
+  spinlock_release(&zero_lock);
+}
+
+// wait until there are enough free frames to put some in the pool
+static
+void
+zeropool_wait_frames(void)
+{
+  spinlock_acquire(&frame_lock);
+  while(free_frame_count < ZERO_LOWATER){
+    zero_starved = true;
+    wchan_sleep(zero_framewchan, &frame_lock);
+  }
+  spinlock_release(&frame_lock);
+}
+
+/*
+ * Keeps the zero pool full. It only zeroes a frame when nothing else
+ * is waiting for its cpu, so it stands in for an idle-priority thread,
+ * and it leaves memory alone while free frames are getting scarce,
+ * sleeping until frames are freed.
+ */
+static
+void
+zero_thread(void *data1, unsigned long data2)
+{
+  paddr_t paddr;
+
+  (void)data1;
+  (void)data2;
+
+  while(1){
+    spinlock_acquire(&zero_lock);
+    while(!zero_enabled || zero_count == ZEROPOOL_MAX){
+      wchan_sleep(zero_wchan, &zero_lock);
+    }
+    spinlock_release(&zero_lock);
+
+    //only a hint, read without the lock
+    if(free_frame_count < ZERO_LOWATER){
+      zeropool_wait_frames();
+      continue;
+    }
+    if(curcpu->c_runqueue.tl_count > 0){
+      thread_yield();
+      continue;
+    }
+
+    paddr = get_frame_address();
+    if(paddr == 0){
+      zeropool_wait_frames();
+      continue;
+    }
+    bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+    spinlock_acquire(&zero_lock);
+    if(zero_enabled && zero_count < ZEROPOOL_MAX){
+      zero_pool[zero_count++] = paddr;
+      zero_filled++;
+      paddr = 0;
+    }
+    spinlock_release(&zero_lock);
+    if(paddr != 0){
+      put_frame(paddr);
+    }
+  }
+}
+
+void ft_zeropool_start(void)
+{
+  int result;
+
+  result = thread_fork("zeroer", NULL, zero_thread, NULL, 0);
+  if(result){
+    panic("ft_zeropool_start: thread_fork failed: %s\n",
+          strerror(result));
+  }
+}
+
+void ft_zeropool_enable(bool enable)
+{
+  paddr_t paddr;
+
+  spinlock_acquire(&zero_lock);
+  zero_enabled = enable;
+  wchan_wakeall(zero_wchan, &zero_lock);
+  spinlock_release(&zero_lock);
+  if(!enable){
+    //empty it, so the pool really is out of the picture
+    while((paddr = zeropool_take(false)) != 0){
+      put_frame(paddr);
+    }
+  }
+}
+
+vaddr_t alloc_kpages(unsigned int npages)
+{
   //if frame table hasn't been initialized, we need to call ram_stealmem
-  //otherwise, we just need to collect a page(frame)
+  //otherwise, we take a buddy block big enough for npages
 
   paddr_t addr;
   vaddr_t result;
-  //int index = 0;
+  unsigned order = 0;
+  int spl;
   // if we have initialized frame table, just use FT
   if(hasInitialized == 1){
-    addr = get_frame_address();
+    while((1U << order) < npages){
+      order++;
+    }
+    if(order > FT_MAX_ORDER){
+      return 0;
+    }
+    if(order == 0){
+      addr = zeropool_take(true);
+      if(addr != 0){
+        return PADDR_TO_KVADDR(addr);
+      }
+      addr = get_frame_address();
+    }else{
+      addr = buddy_alloc(order);
+      if(addr == 0){
+        //frames parked in our cache may be what keeps the buddy
+        //lists from having a big enough block
+        spl = splhigh();
+        framecache_drain(curcpu->c_self, FRAMECACHE_MAX);
+        splx(spl);
+        addr = buddy_alloc(order);
+      }
+      if(addr == 0){
+        //and so may the zero pool
+        zeropool_drain();
+        addr = buddy_alloc(order);
+      }
+    }
   }else{
     spinlock_acquire(&stealmem_lock);
     addr = ram_stealmem(npages);
@@ -122,7 +806,7 @@ vaddr_t alloc_kpages(unsigned int npages)
   if(addr == 0)
     return 0;
   result = PADDR_TO_KVADDR(addr);
-  bzero((void *)result,PAGE_SIZE);
+  bzero((void *)result,npages*PAGE_SIZE);
   //we need to zero out the page we collect
   return result;
 }
@@ -130,21 +814,1009 @@ vaddr_t alloc_kpages(unsigned int npages)
 
 void free_kpages(vaddr_t addr)
 {
-  paddr_t target = 0;
-  target = KVADDR_TO_PADDR(addr);
-  for(int i=0;i<total_frame_number;i++){
+  int index;
+
+  KASSERT((addr & ~PAGE_FRAME) == 0);
+  //pages stolen before the frame table existed are never returned
+  index = frame_index(KVADDR_TO_PADDR(addr));
+  if(index < 0){
+    return;
+  }
+  //the block is ours, so its order can't change under us
+  if(frame_table[index].order == 0){
+    //it may have been a page table
+    frame_table[index].as = NULL;
+    put_frame(frame_table[index].address);
+  }else{
+    buddy_free(index);
+  }
+}
+
+/*
+ * Pager.
+ *
+ * Lock order is frame_lock, then an owner's as_ptlock; the pager
+ * holds one as_ptlock at a time. It never holds either across I/O:
+ * it marks every PTE on the victim's reverse map PTE_BUSY and the
+ * frame busy, drops the locks, writes the page out, and then turns
+ * the PTEs into PTE_SWAPPED entries. Whoever finds a PTE_BUSY entry in
+ * the meantime (an owner faulting on it, or as_destroy) waits in
+ * ft_wait_pte. Because as_destroy waits for busy entries, an owner
+ * can't go away while one of its pages is in transit.
+ *
+ * Frames mapped from a second-level table that is shared since fork
+ * are left alone, those tables are read-only.
+ */
+
+/*
+ * Check that every PTE on FTE's reverse map is resident and in a table
+ * of its own address space, and clear their PTE_REF bits. Returns true
+ * if the frame is evictable, and sets *REF if any of the bits was set.
+ * Call with frame_lock held.
+ */
+static
+bool
+rmap_check(struct frame_table_entry *fte, bool *ref)
+{
+    struct addrspace *as;
+    struct rmap *m;
+    bool ok = true;
+
+    *ref = false;
+    for(m = &fte->rmap; m != NULL && ok; m = m->next){
+        as = pte_owner(m->pte);
+        if(as == NULL){
+            return false;
+        }
+        spinlock_acquire(&as->as_ptlock);
+        if(!(*m->pte & PTE_VALID)){
+            //copy-on-write copy in progress
+            ok = false;
+        }else{
+            KASSERT((*m->pte & PTE_FRAME) == fte->address);
+            if(*m->pte & PTE_REF){
+                *m->pte &= ~PTE_REF;
+                *ref = true;
+            }
+        }
+        spinlock_release(&as->as_ptlock);
+    }
+    return ok;
+}
+
+/*
+ * Give the frame FTE a second chance, or mark it busy for eviction. If
+ * any of its PTEs has PTE_REF set the bits are cleared and the page is
+ * dropped from this cpu's TLB, so the next access faults and sets them
+ * again. Returns true if the frame was picked. Call with frame_lock
+ * held.
+ */
+static
+bool
+victim_try(struct frame_table_entry *fte)
+{
+    struct addrspace *as;
+    struct rmap *m;
+    bool ref;
+
+    if(fte->rmap.pte == NULL){
+        //free, a kernel frame, or a cached page nobody maps
+        return false;
+    }
+    //pairs with the barrier in ft_own_upage
+    membar_load_load();
+    if(fte->busy){
+        return false;
+    }
+    if(!rmap_check(fte, &ref)){
+        return false;
+    }
+    if(ref){
+        for(m = &fte->rmap; m != NULL; m = m->next){
+            vm_tlb_invalidate(pte_owner(m->pte), m->vaddr);
+        }
+        return false;
+    }
+    for(m = &fte->rmap; m != NULL; m = m->next){
+        as = pte_owner(m->pte);
+        spinlock_acquire(&as->as_ptlock);
+        *m->pte = (*m->pte & ~PTE_VALID) | PTE_BUSY;
+        spinlock_release(&as->as_ptlock);
+        as->as_pageouts++;
+    }
+    fte->busy = true;
+    return true;
+}
+
+/*
+ * Pick a victim with the clock algorithm and mark it busy. Returns the
+ * frame index, or -1 if there is no frame that can be evicted. Call
+ * with frame_lock held.
+ */
+static
+int
+clock_select_victim(void)
+{
+    int index;
+
+    KASSERT(spinlock_do_i_hold(&frame_lock));
+
+    //two sweeps: the first may only be clearing reference bits
+    for(int n=0;n<2*total_frame_number;n++){
+        index = clock_hand;
+        clock_hand = (clock_hand + 1) % total_frame_number;
+        if(victim_try(&frame_table[index])){
+            return index;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Same, but only among the pages of AS, for local replacement. A clock
+ * hand of its own (as_rsshand) sweeps AS's address space, skipping
+ * first-level slots without a table of its own. Each call looks at no
+ * more than LOCAL_SCAN_MAX slots, since frame_lock is held throughout;
+ * the hand stays where it stopped, and the caller falls back to global
+ * replacement. Only called from AS's own faults, so its page table
+ * doesn't change shape under us. Call with frame_lock held.
+ */
+#define LOCAL_SCAN_MAX 1024
+
+static
+int
+local_select_victim(struct addrspace *as)
+{
+    struct frame_table_entry *fte;
+    struct rmap *m;
+    vaddr_t va = as->as_rsshand;
+    PTE *table, *pte, entry;
+    int index;
+
+    KASSERT(spinlock_do_i_hold(&frame_lock));
+
+    //a PTE or an empty first-level slot each count as one
+    for(unsigned n=0;n<LOCAL_SCAN_MAX;n++){
+        if(va >= USERSPACETOP){
+            va = 0;
+        }
+        table = as->pagetable[PT_L1_INDEX(va)];
+        if(table == NULL || table_entry(table)->as != as){
+            //nothing here, or shared: on to the next slot
+            va = (va & ~(vaddr_t)0x3fffff) + 0x400000;
+            continue;
+        }
+        pte = &table[PT_L2_INDEX(va)];
+        va += PAGE_SIZE;
+        //only a hint, the frame's reverse map is what counts
+        entry = *pte;
+        if(!(entry & PTE_VALID)){
+            continue;
+        }
+        index = frame_index(entry & PTE_FRAME);
+        fte = &frame_table[index];
+        for(m = &fte->rmap; m != NULL && m->pte != NULL; m = m->next){
+            if(m->pte == pte){
+                break;
+            }
+        }
+        if(m == NULL || m->pte == NULL){
+            continue;
+        }
+        if(victim_try(fte)){
+            as->as_rsshand = va;
+            return index;
+        }
+    }
+    as->as_rsshand = va;
+    return -1;
+}
+
+/*
+ * Put NEWENTRY in every PTE of the busy frame FTE, or with RESTORE make
+ * them resident again, and wake up whoever waits for them. With
+ * NEWENTRY the frame loses its mappings, which go on *FREED.
+ */
+static
+void
+evict_finish(struct frame_table_entry *fte, PTE newentry, bool restore,
+             struct rmap **freed)
+{
+    struct addrspace *as;
+    struct rmap *m;
+
+    spinlock_acquire(&frame_lock);
+    for(m = &fte->rmap; m != NULL; m = m->next){
+        as = pte_owner(m->pte);
+        spinlock_acquire(&as->as_ptlock);
+        KASSERT(*m->pte & PTE_BUSY);
+        if(restore){
+            *m->pte = (*m->pte & ~PTE_BUSY) | PTE_VALID;
+        }else{
+            *m->pte = newentry;
+            as->as_rss--;
+            if(newentry == 0){
+                ft_pte_count(m->pte, -1);
+            }
+        }
+        spinlock_release(&as->as_ptlock);
+        as->as_pageouts--;
+    }
+    if(!restore){
+        rmap_clear(fte, freed);
+    }
+    fte->busy = false;
+    wchan_wakeall(transit_wchan, &frame_lock);
+    spinlock_release(&frame_lock);
+}
+
+/*
+ * Evict a page cache page from the mappings on its reverse map. The
+ * PTEs go back to 0 and the page stays cached with nobody mapping it,
+ * so the next fault finds it again or pc_reclaim takes it.
+ */
+static
+void
+evict_cached_page(struct frame_table_entry *fte, struct rmap **freed)
+{
+    struct addrspace *as;
+    struct rmap *m;
+    bool dirty;
+
+    spinlock_acquire(&frame_lock);
+    for(m = &fte->rmap; m != NULL; m = m->next){
+        as = pte_owner(m->pte);
+        spinlock_acquire(&as->as_ptlock);
+        KASSERT(*m->pte & PTE_BUSY);
+        dirty = (*m->pte & PTE_DIRTY) != 0;
+        *m->pte = 0;
+        as->as_rss--;
+        ft_pte_count(m->pte, -1);
+        spinlock_release(&as->as_ptlock);
+        as->as_pageouts--;
+        pc_unmap(fte->pcpage, dirty);
+    }
+    rmap_clear(fte, freed);
+    fte->busy = false;
+    evict_cached++;
+    wchan_wakeall(transit_wchan, &frame_lock);
+    spinlock_release(&frame_lock);
+}
+
+/*
+ * Evict the busy victim at INDEX. Dirty pages are written to swap
+ * once, and every PTE on the reverse map becomes a reference to the
+ * slot; clean ones are dropped, the PTEs go back to the swap slot they
+ * came from or to 0 if the page was never written at all. A page cache
+ * page is unmapped and handed to the page cache to write back and
+ * reclaim. Returns the physical address of a frame freed this way,
+ * mapped by nobody, or 0 on failure.
+ */
+static
+paddr_t
+evict_frame(int index)
+{
+    struct frame_table_entry *fte = &frame_table[index];
+    struct addrspace *as;
+    struct rmap *m, *freed = NULL;
+    PTE entry;
+    unsigned slot, mappings;
+    bool dirty = false;
+    int result;
+
+    mappings = fte->refcount;
+
+    //the PTEs are no longer valid, make sure no TLB still maps the
+    //page (and nobody can make it dirty) before copying it out. the
+    //reverse map doesn't change while every PTE on it is busy
+    for(m = &fte->rmap; m != NULL; m = m->next){
+        as = pte_owner(m->pte);
+        vm_tlb_shootdown_page(as, m->vaddr);
+        spinlock_acquire(&as->as_ptlock);
+        if(*m->pte & PTE_DIRTY){
+            dirty = true;
+        }
+        spinlock_release(&as->as_ptlock);
+    }
+
+    if(fte->pcpage != NULL){
+        evict_cached_page(fte, &freed);
+        rmap_free(freed);
+        return pc_reclaim();
+    }
+
+    result = 0;
+    if(!dirty){
+        //unchanged since it was paged in or zeroed
+        if(fte->swapslot >= 0){
+            entry = ((PTE)fte->swapslot << 12) | PTE_SWAPPED;
+            fte->swapslot = -1;
+        }else{
+            entry = 0;
+        }
+    }else{
+        KASSERT(fte->swapslot < 0);
+        result = swap_out(fte->address, &slot);
+        entry = (slot << 12) | PTE_SWAPPED;
+    }
+    if(result == 0 && (entry & PTE_SWAPPED)){
+        //one reference to the slot for each PTE
+        for(unsigned i=1;i<mappings;i++){
+            swap_dup(PTE_SLOT(entry));
+        }
+    }
+
+    evict_finish(fte, entry, result != 0, &freed);
+    rmap_free(freed);
+    if(result){
+        //swap is full or broken, the page stays where it was
+        return 0;
+    }
+
+    spinlock_acquire(&frame_lock);
+    if(dirty){
+        evict_dirty++;
+    }else{
+        evict_clean++;
+    }
+    if(mappings > 1){
+        evict_shared++;
+    }
+    spinlock_release(&frame_lock);
+    return fte->address;
+}
+
+// evict the page the clock picks
+static
+paddr_t
+ft_evict(void)
+{
+    int index;
+
+    spinlock_acquire(&frame_lock);
+    index = clock_select_victim();
+    spinlock_release(&frame_lock);
+    if(index < 0){
+        return 0;
+    }
+    return evict_frame(index);
+}
+
+/*
+ * Local replacement: evict one of AS's own pages, for a fault of AS
+ * while it is at its resident set limit. Returns the frame, or 0 if
+ * no page of it that could be evicted turned up.
+ */
+static
+paddr_t
+ft_evict_local(struct addrspace *as)
+{
+    paddr_t paddr;
+    int index;
+
+    if(!swap_enabled()){
+        return 0;
+    }
     spinlock_acquire(&frame_lock);
-    if(frame_table[i].address==target){
-      frame_table[i].isFree=true;
-     spinlock_release(&frame_lock);
-      break;
+    index = local_select_victim(as);
+    spinlock_release(&frame_lock);
+    if(index < 0){
+        return 0;
+    }
+    paddr = evict_frame(index);
+    if(paddr != 0){
+        spinlock_acquire(&frame_lock);
+        evict_local++;
+        spinlock_release(&frame_lock);
+    }
+    return paddr;
+}
+
+// get the frame at PADDR, just evicted, ready for another use. it may
+// have come back from the page cache
+static
+void
+ft_reuse_frame(paddr_t paddr, bool zero)
+{
+    frame_table[frame_index(paddr)].pcpage = NULL;
+    if(zero){
+        bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+    }
+}
+
+/*
+ * Find a frame for a user or page cache page: a free one, or one that
+ * a cached page nobody maps can give up, or else a page out. If ZERO,
+ * it comes back zeroed, from the zero pool if there is one there.
+ */
+static
+paddr_t
+ft_getframe(bool zero)
+{
+  paddr_t paddr = 0;
+
+  if(zero){
+    paddr = zeropool_take(true);
+    if(paddr != 0){
+      return paddr;
+    }
+  }
+  //leave the last few free frames to the kernel, and page out
+  //instead once we get there. the count is read without the lock,
+  //it's only a hint
+  if(!swap_enabled() ||
+     free_frame_count + curcpu->c_numframes > FT_RESERVE_FRAMES){
+    paddr = get_frame_address();
+  }
+  if(paddr == 0 && !zero){
+    paddr = zeropool_take(false);
+  }
+  if(paddr == 0){
+    paddr = pc_reclaim();
+  }
+  if(paddr == 0 && swap_enabled()){
+    paddr = ft_evict();
+  }
+  if(paddr != 0 && zero){
+    bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+  }
+  return paddr;
+}
+
+// make the free frame at PADDR a busy user frame for page VADDR of AS,
+// to be mapped by AS's PTE for it
+static
+void
+ft_own_upage(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+  struct frame_table_entry *fte;
+
+  //nobody else can see this frame yet. the clock reads the reverse
+  //map before busy, so set busy first. the caller has made sure the
+  //second-level table exists and isn't shared
+  fte = &frame_table[frame_index(paddr)];
+  fte->busy = true;
+  fte->refcount = 1;
+  fte->swapslot = -1;
+  fte->pcpage = NULL;
+  fte->rmap.vaddr = vaddr;
+  fte->rmap.next = NULL;
+  membar_store_store();
+  fte->rmap.pte = &as->pagetable[PT_L1_INDEX(vaddr)][PT_L2_INDEX(vaddr)];
+}
+
+paddr_t ft_alloc_upage(struct addrspace *as, vaddr_t vaddr, bool zero)
+{
+  paddr_t paddr = 0;
+
+  //at its limit, a process pays with its own pages (read without the
+  //lock, it's a hint)
+  if(as->as_rss >= as->as_rsscap){
+    paddr = ft_evict_local(as);
+    if(paddr != 0){
+      ft_reuse_frame(paddr, zero);
     }
-   spinlock_release(&frame_lock);
   }
+  if(paddr == 0){
+    paddr = ft_getframe(zero);
+  }
+  if(paddr == 0){
+    return 0;
+  }
+  ft_own_upage(paddr, as, vaddr);
+  return paddr;
+}
+
+paddr_t ft_try_zpage(struct addrspace *as, vaddr_t vaddr)
+{
+  paddr_t paddr;
+
+  if(as->as_rss >= as->as_rsscap){
+    return 0;
+  }
+  paddr = zeropool_take(false);
+  if(paddr == 0){
+    //only when memory is plentiful, the page may never be used.
+    //the count is a hint
+    if(free_frame_count < FT_RESERVE_FRAMES + ZEROPOOL_MAX){
+      return 0;
+    }
+    paddr = get_frame_address();
+    if(paddr == 0){
+      return 0;
+    }
+    bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+  }
+  ft_own_upage(paddr, as, vaddr);
+  return paddr;
+}
+
+paddr_t ft_alloc_cpage(struct pcpage *pc)
+{
+  struct frame_table_entry *fte;
+  paddr_t paddr;
+
+  paddr = ft_getframe(false);
+  if(paddr == 0){
+    return 0;
+  }
+  //nobody maps it yet, so the clock doesn't look at it
+  fte = &frame_table[frame_index(paddr)];
+  fte->busy = false;
+  fte->refcount = 0;
+  fte->swapslot = -1;
+  fte->pcpage = pc;
+  fte->rmap.pte = NULL;
+  fte->rmap.next = NULL;
+  return paddr;
 }
 
+void ft_free_cpage(paddr_t paddr)
+{
+  struct frame_table_entry *fte = &frame_table[frame_index(paddr)];
+
+  KASSERT(fte->rmap.pte == NULL && fte->pcpage != NULL);
+  fte->pcpage = NULL;
+  put_frame(paddr);
+}
 
+int ft_map_cpage(struct addrspace *as, vaddr_t vaddr, PTE *pte,
+                 paddr_t paddr, bool write)
+{
+  struct frame_table_entry *fte = &frame_table[frame_index(paddr)];
+  struct rmap *spare;
+  paddr_t oldpaddr;
+  int result;
 
+  result = rmap_alloc(1, &spare);
+  if(result){
+    pc_unmap(fte->pcpage, write);
+    return result;
+  }
+  //at its limit, a process gives up one of its own pages first
+  if(as->as_rss >= as->as_rsscap){
+    oldpaddr = ft_evict_local(as);
+    if(oldpaddr != 0){
+      ft_reuse_frame(oldpaddr, false);
+      put_frame(oldpaddr);
+    }
+  }
 
+  spinlock_acquire(&frame_lock);
+  //the page cache counts our mapping, so the frame stays its page.
+  //but the pager may be taking it from its other mappings right now
+  while(fte->busy){
+    wchan_sleep(transit_wchan, &frame_lock);
+  }
+  spinlock_acquire(&as->as_ptlock);
+  KASSERT(*pte == 0);
+  *pte = paddr | PTE_VALID | PTE_REF | (write ? PTE_DIRTY : 0);
+  ft_pte_count(pte, 1);
+  as_rss_inc(as);
+  spinlock_release(&as->as_ptlock);
+  rmap_add(fte, pte, vaddr, &spare);
+  spinlock_release(&frame_lock);
 
+  rmap_free(spare);
+  return 0;
+}
 
+void ft_upage_ready(paddr_t paddr, int slot)
+{
+  struct frame_table_entry *fte = &frame_table[frame_index(paddr)];
+
+  KASSERT(fte->busy && fte->rmap.pte != NULL);
+  fte->swapslot = slot;
+  fte->busy = false;
+}
+
+void ft_free_upage(paddr_t paddr)
+{
+  struct frame_table_entry *fte = &frame_table[frame_index(paddr)];
+
+  spinlock_acquire(&frame_lock);
+  fte->rmap.pte = NULL;
+  fte->busy = false;
+  fte->refcount = 0;
+  spinlock_release(&frame_lock);
+  put_frame(paddr);
+}
+
+/*
+ * Sleep until *PTE is not in transit. Called with frame_lock and the
+ * owner's as_ptlock held, returns with both still held.
+ */
+static
+void
+wait_pte_locked(struct addrspace *as, PTE *pte)
+{
+    while(*pte & PTE_BUSY){
+        spinlock_release(&as->as_ptlock);
+        wchan_sleep(transit_wchan, &frame_lock);
+        spinlock_acquire(&as->as_ptlock);
+    }
+}
+
+void ft_wait_pte(struct addrspace *as, PTE *pte)
+{
+  spinlock_acquire(&frame_lock);
+  spinlock_acquire(&as->as_ptlock);
+  wait_pte_locked(as, pte);
+  spinlock_release(&as->as_ptlock);
+  spinlock_release(&frame_lock);
+}
+
+void ft_release_pte(struct addrspace *as, PTE *pte)
+{
+  struct frame_table_entry *fte;
+  struct rmap *freed = NULL;
+  bool lastref = false;
+  int slot = -1;
+  PTE entry;
+
+  spinlock_acquire(&frame_lock);
+  spinlock_acquire(&as->as_ptlock);
+  wait_pte_locked(as, pte);
+  entry = *pte;
+  *pte = 0;
+  if(entry != 0){
+    ft_pte_count(pte, -1);
+  }
+  if(entry & PTE_VALID){
+    as->as_rss--;
+  }
+  spinlock_release(&as->as_ptlock);
+  if(entry & PTE_VALID){
+    fte = &frame_table[frame_index(entry & PTE_FRAME)];
+    KASSERT(!fte->busy);
+    rmap_remove(fte, pte, &freed);
+    if(fte->pcpage != NULL){
+      //stays in the page cache after the last mapping goes
+      pc_unmap(fte->pcpage, (entry & PTE_DIRTY) != 0);
+    }else{
+      lastref = fte->refcount == 0;
+      if(lastref){
+        slot = fte->swapslot;
+        fte->swapslot = -1;
+      }
+    }
+  }
+  spinlock_release(&frame_lock);
+  rmap_free(freed);
+
+  if(lastref){
+    put_frame(entry & PTE_FRAME);
+  }else if(entry & PTE_SWAPPED){
+    slot = PTE_SLOT(entry);
+  }
+  if(slot >= 0){
+    swap_free(slot);
+  }
+}
+
+void ft_dirty_pte(struct addrspace *as, PTE *pte)
+{
+  struct frame_table_entry *fte;
+  int slot = -1;
+
+  spinlock_acquire(&frame_lock);
+  spinlock_acquire(&as->as_ptlock);
+  if((*pte & PTE_VALID) && !(*pte & PTE_DIRTY)){
+    fte = &frame_table[frame_index(*pte & PTE_FRAME)];
+    *pte |= PTE_DIRTY;
+    if(fte->pcpage != NULL){
+      //shared file page, the page cache writes it back
+      pc_dirty(fte->pcpage);
+    }else{
+      KASSERT(fte->refcount == 1 && !(*pte & PTE_COW));
+      //the copy in swap is out of date now
+      slot = fte->swapslot;
+      fte->swapslot = -1;
+    }
+  }
+  spinlock_release(&as->as_ptlock);
+  spinlock_release(&frame_lock);
+
+  if(slot >= 0){
+    swap_free(slot);
+  }
+}
+
+void ft_clean_pte(struct addrspace *as, PTE *pte)
+{
+  struct frame_table_entry *fte;
+
+  spinlock_acquire(&frame_lock);
+  spinlock_acquire(&as->as_ptlock);
+  if((*pte & (PTE_VALID | PTE_DIRTY)) == (PTE_VALID | PTE_DIRTY)){
+    fte = &frame_table[frame_index(*pte & PTE_FRAME)];
+    KASSERT(fte->pcpage != NULL);
+    *pte &= ~PTE_DIRTY;
+    pc_clean(fte->pcpage);
+  }
+  spinlock_release(&as->as_ptlock);
+  spinlock_release(&frame_lock);
+}
+
+/*
+ * Second-level tables shared between address spaces after fork.
+ *
+ * Fork doesn't copy page tables, the child gets the parent's
+ * second-level tables and the slot is marked shared in both (see
+ * PT_L2_ISSHARED). A shared table is read-only: pages in it are
+ * mapped read-only, the clock leaves their frames alone, and before anything
+ * changes a PTE in it (a write, or a fault on a page that isn't
+ * resident) the faulting address space takes a private copy with
+ * ft_split_table. The table's frame table entry counts the sharers,
+ * and has no owner (as) until it is only used by one address space
+ * again and that one splits it.
+ */
+
+void ft_share_pagetable(struct addrspace *as, struct addrspace *copy)
+{
+  struct frame_table_entry *tfte;
+
+  spinlock_acquire(&frame_lock);
+  //a pageout in progress would write its PTE into a shared table
+  while(as->as_pageouts > 0){
+    wchan_sleep(transit_wchan, &frame_lock);
+  }
+  spinlock_acquire(&as->as_ptlock);
+  for(int i=0;i<1024;i++){
+    if(as->pagetable[i] == NULL){
+      continue;
+    }
+    tfte = table_entry(as->pagetable[i]);
+    if(tfte->refcount == 0){
+      tfte->refcount = 1;
+    }
+    tfte->refcount++;
+    tfte->as = NULL;
+    copy->pagetable[i] = as->pagetable[i];
+    PT_L2_SETSHARED(as, i);
+    PT_L2_SETSHARED(copy, i);
+  }
+  //the child's PTEs are ours
+  copy->as_rss = as->as_rss;
+  copy->as_rsspeak = as->as_rss;
+  spinlock_release(&as->as_ptlock);
+  spinlock_release(&frame_lock);
+}
+
+int ft_split_table(struct addrspace *as, unsigned l1)
+{
+  struct frame_table_entry *tfte, *fte;
+  struct rmap *spare;
+  PTE *table, *copy;
+  PTE entry;
+  unsigned resident = 0;
+  int result;
+
+  //nobody changes a shared table, so this count holds
+  table = as->pagetable[l1];
+  for(int j=0;j<1024;j++){
+    if(table[j] & PTE_VALID){
+      resident++;
+    }
+  }
+  //each page in it gets one more mapping, from the copy
+  result = rmap_alloc(resident, &spare);
+  if(result){
+    return result;
+  }
+  copy = (PTE *)alloc_kpages(1);
+  if(copy == NULL){
+    rmap_free(spare);
+    return ENOMEM;
+  }
+
+  spinlock_acquire(&frame_lock);
+  spinlock_acquire(&as->as_ptlock);
+  KASSERT(PT_L2_ISSHARED(as, l1));
+  KASSERT(as->pagetable[l1] == table);
+  tfte = table_entry(table);
+  if(tfte->refcount == 0){
+    //the others have split or exited, nothing to copy. it's ours
+    tfte->as = as;
+    PT_L2_CLRSHARED(as, l1);
+    spinlock_release(&as->as_ptlock);
+    spinlock_release(&frame_lock);
+    free_kpages((vaddr_t)copy);
+    rmap_free(spare);
+    return 0;
+  }
+  for(int j=0;j<1024;j++){
+    entry = table[j];
+    KASSERT(!(entry & PTE_BUSY));
+    if(entry & PTE_VALID){
+      fte = &frame_table[frame_index(entry & PTE_FRAME)];
+      if(fte->pcpage != NULL){
+        //a shared file mapping stays shared
+        pc_dup(fte->pcpage, (entry & PTE_DIRTY) != 0);
+      }else{
+        //the page itself is shared now, copy-on-write for everyone
+        entry |= PTE_COW;
+        table[j] = entry;
+      }
+      rmap_add(fte, &copy[j], (l1 << 22) | (j << 12), &spare);
+    }else if(entry & PTE_SWAPPED){
+      //paging it back in gives a private copy anyway
+      swap_dup(PTE_SLOT(entry));
+    }
+    copy[j] = entry;
+  }
+  tfte->refcount--;
+  if(tfte->refcount == 1){
+    tfte->refcount = 0;
+  }
+  table_entry(copy)->as = as;
+  table_entry(copy)->live = tfte->live;
+  as->pagetable[l1] = copy;
+  PT_L2_CLRSHARED(as, l1);
+  spinlock_release(&as->as_ptlock);
+  spinlock_release(&frame_lock);
+  KASSERT(spare == NULL);
+  return 0;
+}
+
+bool ft_release_table(struct addrspace *as, unsigned l1)
+{
+  struct frame_table_entry *tfte;
+  PTE *table;
+
+  spinlock_acquire(&frame_lock);
+  table = as->pagetable[l1];
+  tfte = table_entry(table);
+  if(tfte->refcount == 0){
+    spinlock_release(&frame_lock);
+    return false;
+  }
+  //the pages stay mapped by the table, the others still use it
+  tfte->refcount--;
+  if(tfte->refcount == 1){
+    tfte->refcount = 0;
+  }
+  spinlock_release(&frame_lock);
+  return true;
+}
+
+int ft_cow_break(struct addrspace *as, vaddr_t vaddr, PTE *pte)
+{
+  struct frame_table_entry *fte;
+  struct rmap *freed = NULL;
+  paddr_t oldpaddr, newpaddr;
+  bool lastref;
+  int slot;
+  PTE entry;
+
+  spinlock_acquire(&frame_lock);
+  spinlock_acquire(&as->as_ptlock);
+  wait_pte_locked(as, pte);
+  entry = *pte;
+  if((entry & (PTE_VALID | PTE_COW)) != (PTE_VALID | PTE_COW)){
+    //not resident, or not shared
+    spinlock_release(&as->as_ptlock);
+    spinlock_release(&frame_lock);
+    return 0;
+  }
+  oldpaddr = entry & PTE_FRAME;
+  fte = &frame_table[frame_index(oldpaddr)];
+  if(fte->refcount == 1){
+    //everyone else has copied it or gone away, it's ours now
+    KASSERT(fte->rmap.pte == pte);
+    *pte = entry & ~PTE_COW;
+    spinlock_release(&as->as_ptlock);
+    spinlock_release(&frame_lock);
+    return 0;
+  }
+  //the pager leaves the frame alone while one of its PTEs is in
+  //transit, so it stays put while we copy it
+  *pte = (entry & ~PTE_VALID) | PTE_BUSY;
+  spinlock_release(&as->as_ptlock);
+  spinlock_release(&frame_lock);
+
+  //not ft_alloc_upage, the copy doesn't add to our resident set
+  newpaddr = ft_getframe(false);
+  if(newpaddr != 0){
+    ft_own_upage(newpaddr, as, vaddr);
+    memmove((void *)PADDR_TO_KVADDR(newpaddr),
+            (const void *)PADDR_TO_KVADDR(oldpaddr), PAGE_SIZE);
+  }
+
+  spinlock_acquire(&frame_lock);
+  spinlock_acquire(&as->as_ptlock);
+  KASSERT(*pte == ((entry & ~PTE_VALID) | PTE_BUSY));
+  if(newpaddr == 0){
+    *pte = entry;
+    spinlock_release(&as->as_ptlock);
+    wchan_wakeall(transit_wchan, &frame_lock);
+    spinlock_release(&frame_lock);
+    return ENOMEM;
+  }
+  *pte = newpaddr | PTE_VALID | PTE_REF | PTE_DIRTY;
+  spinlock_release(&as->as_ptlock);
+  rmap_remove(fte, pte, &freed);
+  lastref = fte->refcount == 0;
+  slot = -1;
+  if(lastref){
+    slot = fte->swapslot;
+    fte->swapslot = -1;
+  }
+  wchan_wakeall(transit_wchan, &frame_lock);
+  spinlock_release(&frame_lock);
+  rmap_free(freed);
+
+  ft_upage_ready(newpaddr, -1);
+  if(lastref){
+    put_frame(oldpaddr);
+  }
+  if(slot >= 0){
+    swap_free(slot);
+  }
+  return 0;
+}
+
+/*
+ * Number of free frames, on the buddy lists, in a cpu's frame cache or
+ * in the zero pool.
+ */
+unsigned ft_free_frames(void)
+{
+  unsigned count, i;
+
+  spinlock_acquire(&frame_lock);
+  count = free_frame_count;
+  spinlock_release(&frame_lock);
+  for(i=0;i<cpu_count();i++){
+    count += cpu_get(i)->c_numframes;
+  }
+  count += zero_count;
+  return count;
+}
+
+/*
+ * Print the buddy free lists and the per-cpu frame cache counters.
+ * Used by the vmstat menu command.
+ */
+void ft_printstats(void)
+{
+  unsigned blocks[FT_MAX_ORDER+1];
+  unsigned i, lookups;
+  struct cpu *c;
+  int index;
+
+  spinlock_acquire(&frame_lock);
+  for(i=0;i<=FT_MAX_ORDER;i++){
+    blocks[i] = 0;
+    for(index=free_area[i];index>=0;index=frame_table[index].next_free){
+      blocks[i]++;
+    }
+  }
+  spinlock_release(&frame_lock);
+
+  kprintf("frames: %d total, %u free\n", total_frame_number,
+          ft_free_frames());
+  kprintf("free blocks by order:");
+  for(i=0;i<=FT_MAX_ORDER;i++){
+    kprintf(" %u", blocks[i]);
+  }
+  kprintf("\n");
+  kprintf("pageouts: %u dirty, %u clean (not written), %u shared, "
+          "%u page cache, %u local (at RSS limit)\n", evict_dirty,
+          evict_clean, evict_shared, evict_cached, evict_local);
+  kprintf("zero pool: %u/%u frames, %u zeroed in advance, %u drained "
+          "for bigger blocks, %u hits, %u misses, %u%% hit rate%s\n",
+          zero_count, ZEROPOOL_MAX, zero_filled, zero_drained,
+          zero_hits, zero_misses,
+          zero_hits + zero_misses == 0 ? 0 :
+          zero_hits * 100 / (zero_hits + zero_misses),
+          zero_enabled ? "" : " (off)");
+  for(i=0;i<cpu_count();i++){
+    c = cpu_get(i);
+    lookups = c->c_frame_hits + c->c_frame_refills;
+    kprintf("cpu%u: %u cached, %u hits, %u refills, %u drains, "
+            "%u%% hit rate\n", c->c_number, c->c_numframes,
+            c->c_frame_hits, c->c_frame_refills, c->c_frame_drains,
+            lookups == 0 ? 0 : c->c_frame_hits * 100 / lookups);
+  }
+}
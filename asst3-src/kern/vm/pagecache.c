@@ -0,0 +1,635 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <pagecache.h>
+
+/*
+ * Page cache.
+ *
+ * Shared file mappings get their pages from here, and so do the whole
+ * pages of read-only program text, so every process that maps a file
+ * page sees the same frame and running a program again finds its text
+ * already in memory. Cached pages are hashed
+ * on (vnode, offset). A page records how many PTEs map it and how
+ * many of those are dirty; the frame table tells them apart from
+ * ordinary user frames by frame_table_entry.pcpage and calls
+ * pc_dup/pc_unmap/pc_dirty as the PTEs change. When the clock picks a
+ * mapped cached frame the pager unmaps it everywhere (through the
+ * frame's reverse map) and leaves the page here. Once nobody maps a
+ * page it goes on an LRU list, and pc_reclaim writes it back if need
+ * be and takes the frame when memory is short.
+ *
+ * pc_lock covers everything here. It comes after frame_lock and
+ * as_ptlock, and is never held across I/O: a page being read in or
+ * reclaimed is marked pc_busy, one being written back pc_writing, and
+ * anyone who needs to wait for them sleeps on pc_wchan.
+ */
+
+struct pcpage {
+	struct vnode *pc_vnode;		/* holds a reference */
+	off_t pc_offset;		/* page-aligned file offset */
+	paddr_t pc_paddr;
+	unsigned pc_maps;		/* PTEs that map the page */
+	unsigned pc_writers;		/* ...and have PTE_DIRTY */
+	bool pc_dirty;			/* file doesn't have our data yet */
+	bool pc_busy;			/* being read in or reclaimed */
+	bool pc_writing;		/* being written back */
+	bool pc_orphan;			/* file truncated, not hashed */
+	unsigned pc_syncgen;		/* last pc_writeback that saw it */
+	struct pcpage *pc_next;		/* hash chain */
+	struct pcpage *pc_lruprev;	/* LRU list, while unmapped */
+	struct pcpage *pc_lrunext;
+};
+
+#define PC_HASHSIZE 128
+
+static struct pcpage *pc_hash[PC_HASHSIZE];
+static struct pcpage *pc_lruhead, *pc_lrutail;
+static struct spinlock pc_lock = SPINLOCK_INITIALIZER;
+static struct wchan *pc_wchan;
+static unsigned pc_syncgen = 0;
+
+static unsigned pc_npages = 0;
+static unsigned pc_hits = 0;
+static unsigned pc_misses = 0;
+static unsigned pc_writebacks = 0;
+static unsigned pc_reclaims = 0;
+static unsigned pc_invalidates = 0;
+
+void
+pc_bootstrap(void)
+{
+	pc_wchan = wchan_create("pagecache");
+	if (pc_wchan == NULL) {
+		panic("pc_bootstrap: wchan_create failed\n");
+	}
+}
+
+static
+unsigned
+pc_hashfn(struct vnode *v, off_t offset)
+{
+	return ((uintptr_t)v / sizeof(void *) + (unsigned)(offset / PAGE_SIZE))
+		% PC_HASHSIZE;
+}
+
+/*
+ * Hash and LRU list helpers. Call with pc_lock held.
+ */
+
+static
+struct pcpage *
+pc_lookup(struct vnode *v, off_t offset)
+{
+	struct pcpage *pc;
+
+	for (pc = pc_hash[pc_hashfn(v, offset)]; pc != NULL;
+	     pc = pc->pc_next) {
+		if (pc->pc_vnode == v && pc->pc_offset == offset) {
+			return pc;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+pc_hash_insert(struct pcpage *pc)
+{
+	unsigned h = pc_hashfn(pc->pc_vnode, pc->pc_offset);
+
+	pc->pc_next = pc_hash[h];
+	pc_hash[h] = pc;
+	pc_npages++;
+}
+
+static
+void
+pc_hash_remove(struct pcpage *pc)
+{
+	struct pcpage **pp;
+
+	pp = &pc_hash[pc_hashfn(pc->pc_vnode, pc->pc_offset)];
+	while (*pp != pc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->pc_next;
+	}
+	*pp = pc->pc_next;
+	pc_npages--;
+}
+
+static
+void
+pc_lru_append(struct pcpage *pc)
+{
+	pc->pc_lrunext = NULL;
+	pc->pc_lruprev = pc_lrutail;
+	if (pc_lrutail != NULL) {
+		pc_lrutail->pc_lrunext = pc;
+	}
+	else {
+		pc_lruhead = pc;
+	}
+	pc_lrutail = pc;
+}
+
+static
+void
+pc_lru_remove(struct pcpage *pc)
+{
+	if (pc->pc_lruprev != NULL) {
+		pc->pc_lruprev->pc_lrunext = pc->pc_lrunext;
+	}
+	else {
+		pc_lruhead = pc->pc_lrunext;
+	}
+	if (pc->pc_lrunext != NULL) {
+		pc->pc_lrunext->pc_lruprev = pc->pc_lruprev;
+	}
+	else {
+		pc_lrutail = pc->pc_lruprev;
+	}
+	pc->pc_lruprev = pc->pc_lrunext = NULL;
+}
+
+static
+void
+pc_map_locked(struct pcpage *pc, bool write)
+{
+	if (pc->pc_maps == 0) {
+		pc_lru_remove(pc);
+	}
+	pc->pc_maps++;
+	if (write) {
+		pc->pc_writers++;
+		pc->pc_dirty = true;
+	}
+}
+
+/*
+ * Page I/O. The file may be shorter than the page: the rest reads as
+ * zeros and isn't written back, so a mapping never makes a file
+ * longer.
+ */
+
+static
+int
+pc_read(struct pcpage *pc)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *page = (char *)PADDR_TO_KVADDR(pc->pc_paddr);
+	int result;
+
+	uio_kinit(&iov, &ku, page, PAGE_SIZE, pc->pc_offset, UIO_READ);
+	result = VOP_READ(pc->pc_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	bzero(page + (PAGE_SIZE - ku.uio_resid), ku.uio_resid);
+	return 0;
+}
+
+static
+int
+pc_write(struct pcpage *pc)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	off_t len;
+	int result;
+
+	result = VOP_STAT(pc->pc_vnode, &st);
+	if (result) {
+		return result;
+	}
+	if (st.st_size <= pc->pc_offset) {
+		/* truncated under us */
+		return 0;
+	}
+	len = st.st_size - pc->pc_offset;
+	if (len > PAGE_SIZE) {
+		len = PAGE_SIZE;
+	}
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pc->pc_paddr), len,
+		  pc->pc_offset, UIO_WRITE);
+	return VOP_WRITE(pc->pc_vnode, &ku);
+}
+
+/*
+ * Write back PC, which is dirty and not busy. Called with pc_lock
+ * held; drops it for the I/O. The page stays dirty if the write fails
+ * or somebody still has it mapped dirty, and might have written to it
+ * while we were copying it out.
+ */
+static
+int
+pc_write_locked(struct pcpage *pc)
+{
+	int result;
+
+	KASSERT(pc->pc_dirty && !pc->pc_busy && !pc->pc_writing);
+	pc->pc_writing = true;
+	pc->pc_dirty = false;
+	spinlock_release(&pc_lock);
+
+	result = pc_write(pc);
+
+	spinlock_acquire(&pc_lock);
+	pc->pc_writing = false;
+	if (!pc->pc_orphan && (result || pc->pc_writers > 0)) {
+		pc->pc_dirty = true;
+	}
+	if (result == 0) {
+		pc_writebacks++;
+	}
+	wchan_wakeall(pc_wchan, &pc_lock);
+	return result;
+}
+
+int
+pc_getpage(struct vnode *v, off_t offset, bool write, paddr_t *ret)
+{
+	struct pcpage *pc, *newpc;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	newpc = NULL;
+	spinlock_acquire(&pc_lock);
+	while (1) {
+		pc = pc_lookup(v, offset);
+		if (pc != NULL && pc->pc_busy) {
+			wchan_sleep(pc_wchan, &pc_lock);
+			continue;
+		}
+		if (pc != NULL) {
+			pc_map_locked(pc, write);
+			pc_hits++;
+			spinlock_release(&pc_lock);
+			if (newpc != NULL) {
+				/* somebody read it in while we got a frame */
+				ft_free_cpage(newpc->pc_paddr);
+				kfree(newpc);
+			}
+			*ret = pc->pc_paddr;
+			return 0;
+		}
+		if (newpc != NULL) {
+			break;
+		}
+		spinlock_release(&pc_lock);
+
+		newpc = kmalloc(sizeof(*newpc));
+		if (newpc == NULL) {
+			return ENOMEM;
+		}
+		newpc->pc_vnode = v;
+		newpc->pc_offset = offset;
+		newpc->pc_maps = 0;
+		newpc->pc_writers = 0;
+		newpc->pc_dirty = false;
+		newpc->pc_busy = true;
+		newpc->pc_writing = false;
+		newpc->pc_orphan = false;
+		newpc->pc_syncgen = 0;
+		newpc->pc_next = NULL;
+		newpc->pc_lruprev = newpc->pc_lrunext = NULL;
+		newpc->pc_paddr = ft_alloc_cpage(newpc);
+		if (newpc->pc_paddr == 0) {
+			kfree(newpc);
+			return ENOMEM;
+		}
+
+		spinlock_acquire(&pc_lock);
+	}
+
+	/* not cached, read it in */
+	pc = newpc;
+	pc_hash_insert(pc);
+	pc_misses++;
+	spinlock_release(&pc_lock);
+
+	VOP_INCREF(v);
+	result = pc_read(pc);
+
+	spinlock_acquire(&pc_lock);
+	if (result) {
+		pc_hash_remove(pc);
+		wchan_wakeall(pc_wchan, &pc_lock);
+		spinlock_release(&pc_lock);
+		VOP_DECREF(v);
+		ft_free_cpage(pc->pc_paddr);
+		kfree(pc);
+		return result;
+	}
+	pc->pc_busy = false;
+	/* not on the LRU list, pc_map_locked mustn't take it off */
+	pc->pc_maps = 1;
+	if (write) {
+		pc->pc_writers = 1;
+		pc->pc_dirty = true;
+	}
+	wchan_wakeall(pc_wchan, &pc_lock);
+	spinlock_release(&pc_lock);
+
+	*ret = pc->pc_paddr;
+	return 0;
+}
+
+bool
+pc_trypage(struct vnode *v, off_t offset, paddr_t *ret)
+{
+	struct pcpage *pc;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	spinlock_acquire(&pc_lock);
+	pc = pc_lookup(v, offset);
+	if (pc == NULL || pc->pc_busy) {
+		spinlock_release(&pc_lock);
+		return false;
+	}
+	pc_map_locked(pc, false);
+	pc_hits++;
+	spinlock_release(&pc_lock);
+
+	*ret = pc->pc_paddr;
+	return true;
+}
+
+void
+pc_dup(struct pcpage *pc, bool dirty)
+{
+	spinlock_acquire(&pc_lock);
+	KASSERT(pc->pc_maps > 0);
+	pc->pc_maps++;
+	if (dirty) {
+		pc->pc_writers++;
+	}
+	spinlock_release(&pc_lock);
+}
+
+void
+pc_unmap(struct pcpage *pc, bool dirty)
+{
+	spinlock_acquire(&pc_lock);
+	KASSERT(pc->pc_maps > 0);
+	pc->pc_maps--;
+	if (dirty) {
+		KASSERT(pc->pc_writers > 0);
+		pc->pc_writers--;
+	}
+	if (pc->pc_maps == 0) {
+		pc_lru_append(pc);
+	}
+	spinlock_release(&pc_lock);
+}
+
+void
+pc_dirty(struct pcpage *pc)
+{
+	spinlock_acquire(&pc_lock);
+	KASSERT(pc->pc_writers < pc->pc_maps);
+	pc->pc_writers++;
+	if (!pc->pc_orphan) {
+		pc->pc_dirty = true;
+	}
+	spinlock_release(&pc_lock);
+}
+
+void
+pc_clean(struct pcpage *pc)
+{
+	spinlock_acquire(&pc_lock);
+	KASSERT(pc->pc_writers > 0);
+	pc->pc_writers--;
+	spinlock_release(&pc_lock);
+}
+
+void
+pc_invalidate(struct vnode *v, off_t offset, off_t len)
+{
+	struct pcpage *pc;
+	off_t pos;
+
+	if (pc_npages == 0) {
+		return;
+	}
+	for (pos = offset - offset % PAGE_SIZE; pos < offset + len;
+	     pos += PAGE_SIZE) {
+		spinlock_acquire(&pc_lock);
+		pc = pc_lookup(v, pos);
+		if (pc == NULL || pc->pc_maps > 0 || pc->pc_dirty ||
+		    pc->pc_busy || pc->pc_writing) {
+			spinlock_release(&pc_lock);
+			continue;
+		}
+		pc_lru_remove(pc);
+		pc_hash_remove(pc);
+		pc_invalidates++;
+		spinlock_release(&pc_lock);
+
+		VOP_DECREF(pc->pc_vnode);
+		ft_free_cpage(pc->pc_paddr);
+		kfree(pc);
+	}
+}
+
+void
+pc_truncate(struct vnode *v)
+{
+	struct pcpage *pc, *dead;
+	unsigned i;
+
+	spinlock_acquire(&pc_lock);
+	for (i = 0; i < PC_HASHSIZE; i++) {
+		dead = NULL;
+		pc = pc_hash[i];
+		while (pc != NULL) {
+			if (pc->pc_vnode != v || pc->pc_busy) {
+				pc = pc->pc_next;
+				continue;
+			}
+			/* dirty or not, what it holds isn't in the file */
+			pc_hash_remove(pc);
+			pc->pc_dirty = false;
+			pc_invalidates++;
+			if (pc->pc_maps > 0 || pc->pc_writing) {
+				/*
+				 * Still in use. Orphan it: nobody finds it
+				 * any more, nothing writes it back over the
+				 * shorter file, and pc_reclaim frees it once
+				 * it is unmapped.
+				 */
+				pc->pc_orphan = true;
+				pc = pc_hash[i];
+				continue;
+			}
+			pc_lru_remove(pc);
+			/* reuse pc_next to chain the dead ones */
+			pc->pc_next = dead;
+			dead = pc;
+			pc = pc_hash[i];
+		}
+		if (dead != NULL) {
+			spinlock_release(&pc_lock);
+			while (dead != NULL) {
+				pc = dead;
+				dead = pc->pc_next;
+				VOP_DECREF(pc->pc_vnode);
+				ft_free_cpage(pc->pc_paddr);
+				kfree(pc);
+			}
+			spinlock_acquire(&pc_lock);
+		}
+	}
+	spinlock_release(&pc_lock);
+}
+
+/*
+ * Write back the dirty pages of V in [START, END), or from START on if
+ * END is negative, or of every file if V is NULL; each at most once.
+ * The lock is dropped for I/O and for waiting, after which the hash
+ * chain is scanned again from the top; pc_syncgen marks the pages
+ * already dealt with.
+ */
+static
+int
+pc_writeback(struct vnode *v, off_t start, off_t end)
+{
+	struct pcpage *pc;
+	unsigned gen, i;
+	int result = 0, err;
+
+	spinlock_acquire(&pc_lock);
+	if (pc_npages == 0) {
+		spinlock_release(&pc_lock);
+		return 0;
+	}
+	gen = ++pc_syncgen;
+	for (i = 0; i < PC_HASHSIZE; i++) {
+	again:
+		for (pc = pc_hash[i]; pc != NULL; pc = pc->pc_next) {
+			if (v != NULL && (pc->pc_vnode != v ||
+					  pc->pc_offset < start ||
+					  (end >= 0 && pc->pc_offset >= end))) {
+				continue;
+			}
+			if (pc->pc_syncgen == gen) {
+				continue;
+			}
+			if (pc->pc_busy || pc->pc_writing) {
+				/* wait for it, a reclaim may be writing it */
+				wchan_sleep(pc_wchan, &pc_lock);
+				goto again;
+			}
+			pc->pc_syncgen = gen;
+			if (pc->pc_dirty) {
+				err = pc_write_locked(pc);
+				if (err && result == 0) {
+					result = err;
+				}
+				goto again;
+			}
+		}
+	}
+	spinlock_release(&pc_lock);
+	return result;
+}
+
+int
+pc_flush(struct vnode *v, off_t offset, off_t len)
+{
+	KASSERT(v != NULL);
+	return pc_writeback(v, offset, offset + len);
+}
+
+int
+pc_sync(struct vnode *v)
+{
+	return pc_writeback(v, 0, -1);
+}
+
+paddr_t
+pc_reclaim(void)
+{
+	struct pcpage *pc;
+	paddr_t paddr;
+	int result;
+
+	spinlock_acquire(&pc_lock);
+	for (pc = pc_lruhead; pc != NULL; pc = pc->pc_lrunext) {
+		if (!pc->pc_writing) {
+			break;
+		}
+	}
+	if (pc == NULL) {
+		spinlock_release(&pc_lock);
+		return 0;
+	}
+	KASSERT(pc->pc_maps == 0 && !pc->pc_busy);
+	pc_lru_remove(pc);
+	pc->pc_busy = true;
+	if (pc->pc_dirty) {
+		spinlock_release(&pc_lock);
+		result = pc_write(pc);
+		spinlock_acquire(&pc_lock);
+		if (result) {
+			/* keep it, and try again another time */
+			pc->pc_busy = false;
+			pc_lru_append(pc);
+			wchan_wakeall(pc_wchan, &pc_lock);
+			spinlock_release(&pc_lock);
+			return 0;
+		}
+		pc_writebacks++;
+	}
+	if (!pc->pc_orphan) {
+		pc_hash_remove(pc);
+	}
+	pc_reclaims++;
+	wchan_wakeall(pc_wchan, &pc_lock);
+	spinlock_release(&pc_lock);
+
+	VOP_DECREF(pc->pc_vnode);
+	paddr = pc->pc_paddr;
+	kfree(pc);
+	return paddr;
+}
+
+void
+pc_shutdown(void)
+{
+	paddr_t paddr;
+
+	while ((paddr = pc_reclaim()) != 0) {
+		ft_free_cpage(paddr);
+	}
+}
+
+void
+pc_printstats(void)
+{
+	unsigned npages, hits, misses, writebacks, reclaims, invalidates;
+
+	spinlock_acquire(&pc_lock);
+	npages = pc_npages;
+	hits = pc_hits;
+	misses = pc_misses;
+	writebacks = pc_writebacks;
+	reclaims = pc_reclaims;
+	invalidates = pc_invalidates;
+	spinlock_release(&pc_lock);
+
+	kprintf("page cache: %u pages, %u hits, %u misses, "
+		"%u write-backs, %u reclaimed, %u invalidated\n",
+		npages, hits, misses, writebacks, reclaims, invalidates);
+}
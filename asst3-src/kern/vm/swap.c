@@ -0,0 +1,193 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * Swap space.
+ *
+ * Evicted pages are written to the raw disk SWAP_DEVICE, one page per
+ * slot; slot N lives at byte offset N*PAGE_SIZE. swap_map records which
+ * slots are in use, and swap_refs[] how many page table entries refer
+ * to each one (more than one after a fork copies a swapped-out page).
+ * The disk driver serializes the I/O itself, so swap_lock only covers
+ * the bitmap and the counters and is never held across I/O.
+ */
+
+#define SWAP_DEVICE "lhd0raw:"
+
+static struct vnode *swap_vnode = NULL;
+static struct bitmap *swap_map;
+static uint16_t *swap_refs;
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static unsigned swap_nslots = 0;
+static unsigned swap_nused = 0;
+static unsigned swap_pageins = 0;
+static unsigned swap_pageouts = 0;
+
+void
+swap_bootstrap(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	int result;
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: stat %s: %s\n", SWAP_DEVICE, strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	swap_refs = kmalloc(swap_nslots * sizeof(swap_refs[0]));
+	if (swap_map == NULL || swap_refs == NULL) {
+		panic("swap: Out of memory for the swap map\n");
+	}
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+void
+swap_dup(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(bitmap_isset(swap_map, slot));
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if (swap_refs[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between the frame at PADDR and slot SLOT.
+ */
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_out(paddr_t paddr, unsigned *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&swap_lock);
+	if (bitmap_alloc(swap_map, slot)) {
+		spinlock_release(&swap_lock);
+		return ENOMEM;
+	}
+	swap_refs[*slot] = 1;
+	swap_nused++;
+	spinlock_release(&swap_lock);
+
+	result = swap_io(paddr, *slot, UIO_WRITE);
+	if (result) {
+		swap_free(*slot);
+		return result;
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_pageouts++;
+	spinlock_release(&swap_lock);
+	return 0;
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+
+	result = swap_io(paddr, slot, UIO_READ);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_pageins++;
+	spinlock_release(&swap_lock);
+	return 0;
+}
+
+void
+swap_printstats(void)
+{
+	unsigned nused, pageins, pageouts;
+
+	if (swap_vnode == NULL) {
+		kprintf("swap: disabled\n");
+		return;
+	}
+
+	spinlock_acquire(&swap_lock);
+	nused = swap_nused;
+	pageins = swap_pageins;
+	pageouts = swap_pageouts;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u/%u slots used, %u page-ins, %u page-outs\n",
+		nused, swap_nslots, pageins, pageouts);
+}
@@ -7,11 +7,94 @@
 #include <machine/tlb.h>
 #include <current.h>
 #include <proc.h>
+#include <cpu.h>
 #include <spl.h>
+#include <clock.h>
+#include <synch.h>
 #include <elf.h>
+#include <swap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <pagecache.h>
 
 /* Place your page table functions here */
 
+// number of calls to vm_fault, summed over the per-cpu counters
+unsigned
+vm_faultcount(void)
+{
+    unsigned count = 0;
+
+    for(unsigned i=0;i<cpu_count();i++){
+        count += cpu_get(i)->c_vm_faults;
+    }
+    return count;
+}
+
+// nanoseconds spent in vm_fault, summed over the per-cpu counters
+uint64_t
+vm_faulttime(void)
+{
+    uint64_t nsecs = 0;
+
+    for(unsigned i=0;i<cpu_count();i++){
+        nsecs += cpu_get(i)->c_vm_faultns;
+    }
+    return nsecs;
+}
+
+
+// number of address space activations, summed over the per-cpu
+// counters
+unsigned
+vm_activatecount(void)
+{
+    unsigned count = 0;
+
+    for(unsigned i=0;i<cpu_count();i++){
+        count += cpu_get(i)->c_as_activates;
+    }
+    return count;
+}
+
+
+static unsigned fa_max = FAULTAROUND_MAX;
+static bool fa_preload = true;
+
+void
+vm_faultaround_set(unsigned maxwindow, bool preload)
+{
+    fa_max = maxwindow > FAULTAROUND_MAX ? FAULTAROUND_MAX : maxwindow;
+    fa_preload = preload;
+}
+
+void
+vm_faultaround_count(unsigned *mapped, unsigned *preloaded)
+{
+    *mapped = 0;
+    *preloaded = 0;
+    for(unsigned i=0;i<cpu_count();i++){
+        *mapped += cpu_get(i)->c_fa_mapped;
+        *preloaded += cpu_get(i)->c_fa_preloaded;
+    }
+}
+
+void
+vm_madvise_count(unsigned *prefetched, unsigned *dropped)
+{
+    *prefetched = 0;
+    *dropped = 0;
+    for(unsigned i=0;i<cpu_count();i++){
+        *prefetched += cpu_get(i)->c_madv_prefetched;
+        *dropped += cpu_get(i)->c_madv_dropped;
+    }
+}
+
+
+// synchronous TLB shootdowns are done one at a time, each other cpu
+// V's shootdown_sem once it has dropped the page
+static struct lock *shootdown_lock;
+static struct semaphore *shootdown_sem;
 
 void vm_bootstrap(void)
 {
@@ -19,16 +102,627 @@ void vm_bootstrap(void)
        frame table here as well.
     */
     ft_initialization();
+    shootdown_lock = lock_create("shootdown");
+    shootdown_sem = sem_create("shootdown", 0);
+    if(shootdown_lock == NULL || shootdown_sem == NULL){
+        panic("vm_bootstrap: out of memory\n");
+    }
+    swap_bootstrap();
+    pc_bootstrap();
+    ft_zeropool_start();
+}
+
+/*
+ * Address space IDs.
+ *
+ * Every cpu hands out the NUM_TLBPID-1 ASIDs (0 is never used) on its
+ * own, and an address space remembers the one it got on each cpu in
+ * as_asids[]. The values stored there carry the cpu's generation
+ * number in the bits above the ASID. When a cpu runs out it flushes
+ * its TLB and starts a new generation, which makes every ASID it
+ * handed out before stale. So a TLB entry is never matched by anyone
+ * but the address space it was loaded for, and nothing has to be
+ * flushed when an address space goes away.
+ *
+ * A process changes its own mappings with local TLB operations only,
+ * so when it moves to another cpu it takes a new ASID there; whatever
+ * that cpu still has from the last time it ran there may be stale.
+ */
+#define ASID_ID(a)   ((a) % NUM_TLBPID)
+#define ASID_GEN(a)  ((a) - ASID_ID(a))
+
+static bool asid_enabled = true;
+
+void
+vm_asid_enable(bool enable)
+{
+    asid_enabled = enable;
+}
+
+// ASID of AS on this cpu, or 0 if it doesn't have a current one
+static
+uint32_t
+asid_get(struct addrspace *as)
+{
+    uint32_t asid = as->as_asids[curcpu->c_number];
+
+    if(ASID_ID(asid) == 0 || ASID_GEN(asid) != curcpu->c_asid_gen){
+        return 0;
+    }
+    return asid;
+}
+
+// invalidate this cpu's whole TLB. call with interrupts off
+static
+void
+tlb_flush(void)
+{
+    for(int i=0;i<NUM_TLB;i++){
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_setasid(curcpu->c_asid_cur);
+}
+
+void
+vm_tlb_activate(struct addrspace *as)
+{
+    struct cpu *c;
+    uint32_t asid;
+    int spl;
+
+    spl = splhigh();
+    c = curcpu->c_self;
+    c->c_as_activates++;
+    asid = asid_get(as);
+    if(asid == 0 || as->as_lastcpu != c->c_number){
+        if(c->c_asid_next == 0 || c->c_asid_next == NUM_TLBPID){
+            //out of ASIDs, start over
+            tlb_flush();
+            c->c_asid_gen += NUM_TLBPID;
+            c->c_asid_next = 1;
+        }
+        asid = c->c_asid_gen | c->c_asid_next++;
+        as->as_asids[c->c_number] = asid;
+        as->as_lastcpu = c->c_number;
+    }
+    if(!asid_enabled){
+        tlb_flush();
+    }
+    c->c_asid_cur = ASID_ID(asid) << TLBHI_PIDSHIFT;
+    tlb_setasid(c->c_asid_cur);
+    splx(spl);
+}
+
+void
+vm_tlb_flush_as(struct addrspace *as)
+{
+    //the ASIDs aren't handed out again until the cpus roll over, so
+    //forgetting them is enough
+    for(unsigned i=0;i<cpu_count();i++){
+        as->as_asids[i] = 0;
+    }
+    if(as == proc_getas()){
+        vm_tlb_activate(as);
+    }
+}
+
+/*
+ * Load a TLB entry for VADDR in the running address space, replacing
+ * the existing entry for VADDR if there is one. Call with interrupts
+ * off.
+ */
+static
+void
+tlb_load(vaddr_t vaddr, uint32_t entryLo)
+{
+    uint32_t entryHi = (vaddr & PAGE_FRAME) | curcpu->c_asid_cur;
+    int index;
+
+    index = tlb_probe(entryHi, 0);
+    if(index >= 0){
+        tlb_write(entryHi, entryLo, index);
+    }else{
+        tlb_random(entryHi, entryLo);
+    }
+}
+
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+    uint32_t asid;
+    int spl, index;
+
+    spl = splhigh();
+    asid = asid_get(as);
+    if(asid != 0){
+        index = tlb_probe((vaddr & PAGE_FRAME) |
+                          (ASID_ID(asid) << TLBHI_PIDSHIFT), 0);
+        if(index >= 0){
+            tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+        }
+        tlb_setasid(curcpu->c_asid_cur);
+    }
+    splx(spl);
+}
+
+/*
+ * Remove AS's page VADDR from every cpu's TLB and wait until they have
+ * all done it. Must not be called with spinlocks held.
+ */
+void
+vm_tlb_shootdown_page(struct addrspace *as, vaddr_t vaddr)
+{
+    struct tlbshootdown ts;
+    unsigned i, sent = 0;
+
+    vm_tlb_invalidate(as, vaddr);
+    if(cpu_count() == 1){
+        return;
+    }
+
+    ts.ts_as = as;
+    ts.ts_vaddr = vaddr;
+    ts.ts_done = shootdown_sem;
+    lock_acquire(shootdown_lock);
+    for(i=0;i<cpu_count();i++){
+        if(cpu_get(i) != curcpu->c_self){
+            ipi_tlbshootdown(cpu_get(i), &ts);
+            sent++;
+        }
+    }
+    while(sent > 0){
+        P(shootdown_sem);
+        sent--;
+    }
+    lock_release(shootdown_lock);
 }
 
+/*
+ * Fill the frame at PADDR with page VADDR of region R, from the file
+ * the region was loaded from. The part of the page outside the
+ * file's data (BSS, or the ends of the segment) is zeroed.
+ */
+static
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+file_fill(region *r, vaddr_t vaddr, paddr_t paddr)
 {
-    //if we have READONLY fault, just return error type
-    if(faulttype == VM_FAULT_READONLY){
-        //panic("READONLY\n");
-        return EFAULT;
+    struct iovec iov;
+    struct uio ku;
+    vaddr_t start, end;
+    char *page = (char *)PADDR_TO_KVADDR(paddr);
+    int result;
+
+    start = vaddr > r->filevaddr ? vaddr : r->filevaddr;
+    end = vaddr + PAGE_SIZE;
+    if(end > r->filevaddr + r->filesize){
+        end = r->filevaddr + r->filesize;
+    }
+    if(start >= end){
+        bzero(page, PAGE_SIZE);
+        return 0;
+    }
+
+    bzero(page, start - vaddr);
+    bzero(page + (end - vaddr), vaddr + PAGE_SIZE - end);
+    uio_kinit(&iov, &ku, page + (start - vaddr), end - start,
+              r->fileoffset + (start - r->filevaddr), UIO_READ);
+    result = VOP_READ(r->vnode, &ku);
+    if(result){
+        return result;
+    }
+    if(ku.uio_resid != 0){
+        //executable got shorter under us
+        return EIO;
+    }
+    return 0;
+}
+
+/*
+ * Whether page VADDR of region R comes from the page cache, and if so
+ * at which file offset. All pages of a shared file mapping do. So do
+ * the whole pages of a read-only segment of an executable (its text)
+ * when they line up with the file's pages, so every process running
+ * the program maps the same frames; a partial page at either end is
+ * private, it needs zeroes where the file has other data.
+ */
+static
+bool
+cached_page(struct addrspace *as, region *r, vaddr_t vaddr, off_t *offset)
+{
+    if(r->shared){
+        *offset = r->fileoffset + (vaddr - r->vbase);
+        return true;
+    }
+    if(r->vnode == NULL || (r->permission & PF_W) || as->isPrepared ||
+       vaddr < r->filevaddr || vaddr - r->filevaddr > r->filesize ||
+       r->filesize - (vaddr - r->filevaddr) < PAGE_SIZE){
+        return false;
+    }
+    *offset = r->fileoffset + (vaddr - r->filevaddr);
+    return *offset % PAGE_SIZE == 0;
+}
+
+/*
+ * Make the page behind *PTE resident and load it into the TLB. Pages
+ * that were never touched get a zeroed frame, or are read in from the
+ * executable if region R was loaded from one; swapped out pages are
+ * read back in from swap. Pages of a shared file mapping, and whole
+ * text pages, come from the page cache. WRITE says the fault was a
+ * write, WRITABLE whether the region allows writes at all.
+ *
+ * A page only goes into the TLB writable once it is dirty, so the
+ * first write to it faults and sets PTE_DIRTY. Copy-on-write pages and
+ * pages in a shared table are always read-only.
+ */
+static
+int
+pt_fault(struct addrspace *as, region *r, vaddr_t vaddr, PTE *pte,
+         bool write, bool writable)
+{
+    PTE entry;
+    paddr_t paddr;
+    off_t offset;
+    int result;
+
+    while(1){
+        spinlock_acquire(&as->as_ptlock);
+        entry = *pte;
+        if(entry & PTE_VALID && PT_L2_ISSHARED(as, PT_L1_INDEX(vaddr))){
+            //table shared since fork, read-only and no reference bit
+            KASSERT(!write);
+            tlb_load(vaddr, (entry & PTE_FRAME) | TLBLO_VALID);
+            spinlock_release(&as->as_ptlock);
+            return 0;
+        }
+        if(entry & PTE_VALID && write && !(entry & PTE_DIRTY)){
+            //first write since it came in
+            spinlock_release(&as->as_ptlock);
+            ft_dirty_pte(as, pte);
+            continue;
+        }
+        if(entry & PTE_VALID){
+            //already resident, just refill the TLB
+            *pte = entry | PTE_REF;
+            tlb_load(vaddr, (entry & PTE_FRAME) | TLBLO_VALID |
+                     (writable && (entry & PTE_DIRTY) && !(entry & PTE_COW) ?
+                      TLBLO_DIRTY : 0));
+            spinlock_release(&as->as_ptlock);
+            return 0;
+        }
+        KASSERT(!PT_L2_ISSHARED(as, PT_L1_INDEX(vaddr)));
+        spinlock_release(&as->as_ptlock);
+        if(!(entry & PTE_BUSY)){
+            break;
+        }
+        //being paged out right now, wait and look again
+        ft_wait_pte(as, pte);
+    }
+
+    //only we change entries that aren't resident, so entry stays
+    //valid while we sleep for a frame or for swap
+    KASSERT(entry == 0 || !r->shared);
+    if(entry == 0 && cached_page(as, r, vaddr, &offset)){
+        result = pc_getpage(r->vnode, offset, write, &paddr);
+        if(result){
+            return result;
+        }
+        result = ft_map_cpage(as, vaddr, pte, paddr, write);
+        if(result){
+            return result;
+        }
+        //resident now, go round again to load the TLB
+        return pt_fault(as, r, vaddr, pte, write, writable);
+    }
+    //untouched anonymous pages want a zeroed frame, from the zero pool
+    paddr = ft_alloc_upage(as, vaddr,
+                           !(entry & PTE_SWAPPED) && r->vnode == NULL);
+    if(paddr == 0){ // memory is full
+        return ENOMEM;
+    }
+    if(entry & PTE_SWAPPED){
+        result = swap_in(PTE_SLOT(entry), paddr);
+        as->as_majflt++;
+    }else if(r->vnode != NULL){
+        result = file_fill(r, vaddr, paddr);
+        as->as_majflt++;
+    }else{
+        result = 0;
+    }
+    if(result){
+        ft_free_upage(paddr);
+        return result;
+    }
+
+    spinlock_acquire(&as->as_ptlock);
+    KASSERT(*pte == entry);
+    if(entry == 0){
+        ft_pte_count(pte, 1);
+    }
+    if(write){
+        *pte = paddr | PTE_VALID | PTE_REF | PTE_DIRTY;
+        tlb_load(vaddr, paddr | TLBLO_VALID | TLBLO_DIRTY);
+    }else{
+        *pte = paddr | PTE_VALID | PTE_REF;
+        tlb_load(vaddr, paddr | TLBLO_VALID);
+    }
+    as_rss_inc(as);
+    spinlock_release(&as->as_ptlock);
+
+    if((entry & PTE_SWAPPED) && !write){
+        //clean, the frame keeps the slot so it can be dropped later
+        ft_upage_ready(paddr, PTE_SLOT(entry));
+    }else{
+        ft_upage_ready(paddr, -1);
+        if(entry & PTE_SWAPPED){
+            swap_free(PTE_SLOT(entry));
+        }
+    }
+    return 0;
+}
+
+/*
+ * Map page VADDR of region R ahead of a fault, if that is cheap: it is
+ * resident already, or it is an untouched anonymous page and a zeroed
+ * frame is at hand, or it comes from the page cache and is there
+ * already. Nothing is read from disk. With preloading on the
+ * page also goes into the TLB, read-only unless it is dirty, the same
+ * way pt_fault would load it. The reference bit isn't set, the page
+ * hasn't been used yet. Returns false if VADDR's table is missing.
+ */
+static
+bool
+fault_ahead(struct addrspace *as, region *r, vaddr_t vaddr, bool writable)
+{
+    unsigned l1 = PT_L1_INDEX(vaddr);
+    PTE *pte, entry;
+    paddr_t paddr;
+    off_t offset;
+
+    spinlock_acquire(&as->as_ptlock);
+    if(as->pagetable[l1] == NULL){
+        spinlock_release(&as->as_ptlock);
+        return false;
+    }
+    pte = &as->pagetable[l1][PT_L2_INDEX(vaddr)];
+    entry = *pte;
+    spinlock_release(&as->as_ptlock);
+
+    if(entry == 0 && r->vnode == NULL && !PT_L2_ISSHARED(as, l1)){
+        paddr = ft_try_zpage(as, vaddr);
+        if(paddr == 0){
+            return true;
+        }
+        //only we change entries that aren't resident
+        spinlock_acquire(&as->as_ptlock);
+        KASSERT(*pte == 0);
+        entry = *pte = paddr | PTE_VALID;
+        ft_pte_count(pte, 1);
+        as_rss_inc(as);
+        spinlock_release(&as->as_ptlock);
+        ft_upage_ready(paddr, -1);
+        curcpu->c_fa_mapped++;
+    }else if(entry == 0 && !PT_L2_ISSHARED(as, l1) &&
+             as->as_rss < as->as_rsscap &&
+             cached_page(as, r, vaddr, &offset) &&
+             pc_trypage(r->vnode, offset, &paddr)){
+        if(ft_map_cpage(as, vaddr, pte, paddr, false)){
+            return true;
+        }
+        spinlock_acquire(&as->as_ptlock);
+        if(*pte & PTE_VALID){
+            *pte &= ~PTE_REF;
+        }
+        entry = *pte;
+        spinlock_release(&as->as_ptlock);
+        curcpu->c_fa_mapped++;
+    }
+    if(!fa_preload || !(entry & PTE_VALID)){
+        return true;
+    }
+
+    spinlock_acquire(&as->as_ptlock);
+    //look again, it may have been paged out meanwhile
+    entry = *pte;
+    if(entry & PTE_VALID){
+        tlb_load(vaddr, (entry & PTE_FRAME) | TLBLO_VALID |
+                 (writable && (entry & PTE_DIRTY) && !(entry & PTE_COW) &&
+                  !PT_L2_ISSHARED(as, l1) ? TLBLO_DIRTY : 0));
+        curcpu->c_fa_preloaded++;
+    }
+    spinlock_release(&as->as_ptlock);
+    return true;
+}
+
+/*
+ * Drop the resident pages [START, END) of MADV_SEQUENTIAL region R,
+ * which the process has gone past. Page cache pages are unmapped, they
+ * stay cached and cost nothing to map again. Anything else may be the
+ * only copy of its data, so it just loses its reference bit and TLB
+ * entry, and is the first thing the pager takes. Tables still shared
+ * since fork are left alone.
+ */
+static
+void
+drop_behind(struct addrspace *as, region *r, vaddr_t start, vaddr_t end)
+{
+    unsigned l1;
+    PTE *pte, entry;
+
+    for(vaddr_t va = start; va < end; va += PAGE_SIZE){
+        l1 = PT_L1_INDEX(va);
+        spinlock_acquire(&as->as_ptlock);
+        if(as->pagetable[l1] == NULL || PT_L2_ISSHARED(as, l1)){
+            spinlock_release(&as->as_ptlock);
+            continue;
+        }
+        pte = &as->pagetable[l1][PT_L2_INDEX(va)];
+        entry = *pte;
+        if(!(entry & PTE_VALID) || (entry & PTE_BUSY)){
+            spinlock_release(&as->as_ptlock);
+            continue;
+        }
+        if(!r->shared){
+            *pte = entry & ~PTE_REF;
+        }
+        spinlock_release(&as->as_ptlock);
+        if(r->shared){
+            ft_release_pte(as, pte);
+        }
+        vm_tlb_invalidate(as, va);
+        curcpu->c_madv_dropped++;
+    }
+}
+
+/*
+ * Fault-around for a fault on page VADDR of region R, see vm.h. A fault
+ * within a window past the last one (either way) counts as sequential,
+ * the next fault would have been right there, so the window grows, and
+ * the pages after VADDR in that direction are mapped ahead. Any other
+ * fault shrinks it. A second fault on the same page (the first write
+ * to a page that was read) leaves it as it is.
+ */
+static
+void
+fault_around(struct addrspace *as, region *r, vaddr_t vaddr, bool writable)
+{
+    vaddr_t rstart = r->vbase;
+    vaddr_t rend = r->vbase + r->npages * PAGE_SIZE;
+    vaddr_t next, behind;
+    unsigned window = as->fa_window;
+    int dir;
+
+    if(vaddr == as->fa_last || r->advice == MADV_RANDOM){
+        return;
+    }
+    if(r->advice == MADV_SEQUENTIAL){
+        //no need to wait for the window to grow, and what is a window
+        //behind the previous fault won't be used again
+        window = fa_max * 2;
+        dir = 1;
+        if(vaddr > as->fa_last && as->fa_last >= rstart){
+            behind = (window + 1) * PAGE_SIZE;
+            drop_behind(as, r, as->fa_last - rstart > behind ?
+                        as->fa_last - behind : rstart, as->fa_last);
+        }
+    }else{
+        dir = vaddr > as->fa_last ? 1 : -1;
+        if((dir > 0 && vaddr - as->fa_last <= (window + 1) * PAGE_SIZE) ||
+           (dir < 0 && as->fa_last - vaddr <= (window + 1) * PAGE_SIZE)){
+            window = window == 0 ? 1 : window * 2;
+        }else{
+            window /= 2;
+        }
+        if(window > fa_max){
+            window = fa_max;
+        }
+    }
+    as->fa_window = window;
+    as->fa_last = vaddr;
+
+    next = vaddr;
+    for(unsigned i=0;i<window;i++){
+        if(dir > 0 ? next + PAGE_SIZE >= rend : next <= rstart){
+            break;
+        }
+        next = dir > 0 ? next + PAGE_SIZE : next - PAGE_SIZE;
+        if(!fault_ahead(as, r, next, writable)){
+            break;
+        }
+    }
+}
+
+/*
+ * Fault in page VADDR of region R: make sure its second-level table
+ * exists and is ours if it has to be, break copy-on-write for a write,
+ * then let pt_fault do the rest.
+ */
+static
+int
+fault_page(struct addrspace *as, region *r, vaddr_t vaddr, bool write,
+           bool writable)
+{
+    //get index of page table element first
+    int first_page_index;
+    int second_page_index;
+    PTE ** pagetable;
+    pagetable = as->pagetable;
+    first_page_index = PT_L1_INDEX(vaddr);
+    second_page_index = PT_L2_INDEX(vaddr);
+    //check whehter page entry exists or not
+    //since pagetable is a lazy structure, 
+    //we will allocate if it doesn't exist
+    if(pagetable[first_page_index]==NULL){
+        PTE *table = (PTE *)alloc_kpages(1);
+        if(table == NULL){
+            return ENOMEM;
+        }
+        ft_own_table(as, table);
+        spinlock_acquire(&as->as_ptlock);
+        pagetable[first_page_index] = table;
+        spinlock_release(&as->as_ptlock);
     }
+    //second-level table shared since fork. reads of resident pages
+    //can use it as it is, anything else needs our own copy
+    int result;
+    spinlock_acquire(&as->as_ptlock);
+    int shared = PT_L2_ISSHARED(as, first_page_index);
+    PTE entry = pagetable[first_page_index][second_page_index];
+    spinlock_release(&as->as_ptlock);
+    if(shared && (write || !(entry & PTE_VALID))){
+        result = ft_split_table(as, first_page_index);
+        if(result){
+            return result;
+        }
+    }
+    PTE *pte = &pagetable[first_page_index][second_page_index];
+    //writing to a page shared since fork, take a private copy first
+    if(write){
+        result = ft_cow_break(as, vaddr, pte);
+        if(result){
+            return result;
+        }
+    }
+    return pt_fault(as, r, vaddr, pte, write, writable);
+}
+
+int
+vm_willneed(struct addrspace *as, region *r, vaddr_t start, vaddr_t end)
+{
+    bool writable = (r->permission & PF_W) || as->isPrepared;
+    unsigned l1;
+    PTE entry;
+    int result;
+
+    for(vaddr_t va = start; va < end; va += PAGE_SIZE){
+        if(as->as_rss >= as->as_rsscap){
+            //would only push out pages of our own
+            break;
+        }
+        l1 = PT_L1_INDEX(va);
+        spinlock_acquire(&as->as_ptlock);
+        entry = as->pagetable[l1] == NULL ? 0 :
+            as->pagetable[l1][PT_L2_INDEX(va)];
+        spinlock_release(&as->as_ptlock);
+        if(entry & PTE_VALID){
+            continue;
+        }
+        result = fault_page(as, r, va, false, writable);
+        if(result == ENOMEM){
+            //only a hint
+            break;
+        }
+        if(result){
+            return result;
+        }
+        curcpu->c_madv_prefetched++;
+    }
+    return 0;
+}
+
+static
+int
+do_vm_fault(int faulttype, vaddr_t faultaddress)
+{
     if(faultaddress == 0){
         //panic("null should work\n");
         return EFAULT;
@@ -39,107 +733,71 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
     }
     // check region is valid or not
-     int valid_region = 0; // if region is valid, we set it to 1
-     struct region_element * current;
-     struct addrspace * as = proc_getas();
-     current = as->head_region;
-     //int flag = 0;
+    struct addrspace * as = proc_getas();
+    as->as_faults++;
     uint32_t test_address = faultaddress & PAGE_FRAME;
-    while(current != NULL){
-        vaddr_t top = current->vbase + (current->npages * PAGE_SIZE);
-        if(test_address < top && test_address >= current->vbase){
-       //     flag = current->permission;
-            valid_region = 1;
-        }
-        current = current->next;
+    region *current = as_find_region(as, test_address);
+    if(current == NULL){
+        //just below the stack, it grows down
+        current = as_grow_stack(as, test_address);
     }
-    if(valid_region == 0){
+    if(current == NULL){
       //`  panic("invalid region\n");
         return EFAULT;
     }
     // check permission
+    //while the program is being loaded every region is writeable
+    bool write = faulttype != VM_FAULT_READ;
+    bool writable = (current->permission & PF_W) || as->isPrepared;
     //if we try to read but no read permission
-    // if(faulttype == VM_FAULT_READ){
-    //     if(!(flag & PF_R)){
-    //         panic("r flag\n");
-    //         return EFAULT;
-    //     }
-    // }
-    // if(faulttype == VM_FAULT_WRITE){
-    //     if(!(flag & PF_W)){
-    //         panic("w flag\n");
-    //         return EFAULT;
-    //     }
-    // }
-
+    if(!write && !(current->permission & (PF_R | PF_X)) && !as->isPrepared){
+        return EFAULT;
+    }
     //if we try to write but no write permission
+    if(write && !writable){
+        return EFAULT;
+    }
 
-    //get index of page table element first
-    int first_page_index;
-    int second_page_index;
-    PTE ** pagetable;
-    pagetable = as->pagetable;
-    first_page_index = faultaddress >> 22;
-    second_page_index = (faultaddress >> 12) & 0x3ff;
-    //check whehter page entry exists or not
-    //since pagetable is a lazy structure, 
-    //we will allocate if it doesn't exist
-    if(pagetable[first_page_index]==NULL){
-        pagetable[first_page_index] = (PTE *)alloc_kpages(1);
-    }
-    // if we don't entry, we need to make one for it
-    if(pagetable[first_page_index][second_page_index]== 0){
-        //first 20 bits for frame number
-        //int frame = get_frame_index();
-        paddr_t temp = get_frame_address();
-        //uint32_t entry = 0;
-        //entry = KVADDR_TO_PADDR(temp);
-        //frame = frame * 4096;
-        if(temp == 0){ // memory is full
-            //panic("no memory for page table\n");
-            return ENOMEM;
-        }
-       // entry = temp | TLBLO_VALID;
-        //entry = entry | TLBLO_DIRTY;
-        pagetable[first_page_index][second_page_index] = temp;
-    }
-    int spl = splhigh();
-    //invalid TODO
-
-    //pick a random entry and replace it
-    uint32_t entryHi = faultaddress & PAGE_FRAME;
-    uint32_t entryLo = pagetable[first_page_index][second_page_index] | TLBLO_VALID | TLBLO_DIRTY;
-   // uint32_t testHi = 0;
-    //uint32_t testLo = 0;
-    //kprintf("searching\n");
-    // int tlb_index = 1000; // using some oversize number
-    // for(int i=0;i<NUM_TLB;i++){
-    //     tlb_read(&testHi,&testLo,i);
-    //     if(!(testLo & TLBLO_VALID)){
-    //         tlb_index = i;
-    //         break;
-    //     }
-    // }
-    // if(tlb_index == 1000){
-    //     tlb_random(entryHi,entryLo);
-    // }else{
-    //     tlb_write(entryHi,entryLo,tlb_index);
-    // }
-    tlb_random(entryHi,entryLo);
-    splx(spl);
+    int result = fault_page(as, current, test_address, write, writable);
+    if(result){
+        return result;
+    }
+    fault_around(as, current, test_address, writable);
     return 0;
+}
 
+//counts the fault and the time it took, so the zpb and vmstat menu
+//commands can report fault latency
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+    struct timespec before, after, duration;
+    int result, spl;
+
+    gettime(&before);
+    result = do_vm_fault(faulttype, faultaddress);
+    gettime(&after);
+    timespec_sub(&after, &before, &duration);
+
+    //we may have moved to another cpu while we slept
+    spl = splhigh();
+    curcpu->c_vm_faults++;
+    curcpu->c_vm_faultns += duration.tv_sec * 1000000000ULL +
+        duration.tv_nsec;
+    splx(spl);
+    return result;
 }
 
 /*
- *
- * SMP-specific functions.  Unused in our configuration.
+ * SMP-specific functions.
  */
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+	vm_tlb_invalidate(ts->ts_as, ts->ts_vaddr);
+	if (ts->ts_done != NULL) {
+		V(ts->ts_done);
+	}
 }
 
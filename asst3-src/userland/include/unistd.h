@@ -43,6 +43,7 @@
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -150,6 +151,9 @@ int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
+int getrusage(int who, struct rusage *usage);
+int getrlimit(int resource, struct rlimit *rl);
+int setrlimit(int resource, const struct rlimit *rl);
 
 /*
  * These are not themselves system calls, but wrapper routines in libc.
@@ -170,4 +174,13 @@ time_t time(time_t *seconds);			/* calls __time */
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
 
+/* madvise() hints */
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+
+int madvise(void *addr, size_t len, int advice);
+
 #endif /* _UNISTD_H_ */
@@ -34,6 +34,9 @@
  *
  * It should also continue to work after subsequent assignments, most
  * notably after implementing the virtual memory system.
+ *
+ * With -b it instead measures how long fork takes for address spaces
+ * of various sizes.
  */
 
 #include <unistd.h>
@@ -42,6 +45,10 @@
 #include <stdio.h>
 #include <err.h>
 
+#define PAGE_SIZE	4096
+#define BENCH_MAXPAGES	1024	/* one full second-level page table */
+#define BENCH_FORKS	32
+
 /*
  * This is used by all processes, to try to help make sure all
  * processes have a distinct address space.
@@ -166,6 +173,66 @@ test(int nowait)
 	putchar('\n');
 }
 
+/*
+ * Fork benchmark. Touch NPAGES pages of BUF so the address space has
+ * that much more in it, then time BENCH_FORKS fork/exit/waitpid
+ * rounds and print the average in microseconds.
+ */
+static
+void
+benchfork(char *buf, unsigned npages)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	unsigned long usecs;
+	unsigned i;
+	int pid, x;
+
+	for (i=0; i<npages; i++) {
+		buf[i * PAGE_SIZE] = 1;
+	}
+
+	__time(&s0, &ns0);
+	for (i=0; i<BENCH_FORKS; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(0);
+		}
+		if (waitpid(pid, &x, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	__time(&s1, &ns1);
+
+	usecs = (s1 - s0) * 1000000UL;
+	usecs += ns1 / 1000;
+	usecs -= ns0 / 1000;
+	printf("%4u pages touched: %lu us per fork\n",
+	       npages, usecs / BENCH_FORKS);
+}
+
+static
+void
+bench(void)
+{
+	static const unsigned sizes[] = { 0, 16, 64, 256, BENCH_MAXPAGES };
+	char *buf;
+	unsigned i;
+
+	/* only the benchmark needs it, so the plain test stays small */
+	buf = malloc(BENCH_MAXPAGES * PAGE_SIZE);
+	if (buf == NULL) {
+		errx(1, "malloc failed");
+	}
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		benchfork(buf, sizes[i]);
+	}
+	free(buf);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -176,8 +243,12 @@ main(int argc, char *argv[])
 	if (argc==2 && !strcmp(argv[1], "-w")) {
 		nowait=1;
 	}
+	else if (argc==2 && !strcmp(argv[1], "-b")) {
+		bench();
+		return 0;
+	}
 	else if (argc!=1 && argc!=0) {
-		warnx("usage: forktest [-w]");
+		warnx("usage: forktest [-w|-b]");
 		return 1;
 	}
 	warnx("Starting. Expect this many:");